@@ -8,7 +8,7 @@ _ww() {
 
     opts="-o --output -m --mode -c --color -l --loop -S --slideshow -i --interval \
           -r --random -R --recursive -t --transition -d --duration -f --fps \
-          -D --daemon -L --list-outputs -v --version -h --help"
+          -j --threads -p --progressive -D --daemon -L --list-outputs -v --version -h --help"
 
     case "${prev}" in
         -o|--output)
@@ -46,6 +46,10 @@ _ww() {
             COMPREPLY=( $(compgen -W "15 30 60 120 144 240" -- ${cur}) )
             return 0
             ;;
+        -j|--threads)
+            COMPREPLY=( $(compgen -W "1 2 4 8" -- ${cur}) )
+            return 0
+            ;;
     esac
 
     if [[ ${cur} == -* ]] ; then
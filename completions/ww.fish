@@ -21,10 +21,14 @@ complete -c ww -s d -l duration -d 'Transition duration in seconds' -xa '0.5 1.0
 # FPS
 complete -c ww -s f -l fps -d 'Transition frame rate' -xa '15 30 60 120 144 240'
 
+# Threads
+complete -c ww -s j -l threads -d 'Limit threads used for scaling' -xa '1 2 4 8'
+
 # Boolean flags
 complete -c ww -s l -l loop -d 'Loop animated wallpapers'
 complete -c ww -s S -l slideshow -d 'Slideshow mode'
 complete -c ww -s r -l random -d 'Random slideshow order'
+complete -c ww -s p -l progressive -d 'Show a quick preview first'
 complete -c ww -s R -l recursive -d 'Scan directories recursively'
 complete -c ww -s D -l daemon -d 'Run in background and restore from cache'
 complete -c ww -s L -l list-outputs -d 'List available outputs'
@@ -31,6 +31,7 @@
           buildInputs = with pkgs; [
             wayland
             wayland-protocols
+            libjpeg
             libwebp
             libtiff
             libjxl
@@ -64,7 +65,7 @@
                 -Iinc \
                 -Ibuild/protocols \
                 -I${pkgs.stb}/include/stb \
-                $(pkg-config --cflags wayland-client libwebp libtiff-4 libjxl libavcodec libavformat libavutil libswscale) \
+                $(pkg-config --cflags wayland-client libjpeg libwebp libwebpdemux libtiff-4 libjxl libavcodec libavformat libavutil libswscale) \
                 -fno-exceptions -fno-rtti
             done
 
@@ -72,7 +73,7 @@
             $CXX build/obj/*.o \
               -o ww \
               -pthread \
-              $(pkg-config --libs wayland-client libwebp libtiff-4 libjxl libavcodec libavformat libavutil libswscale) \
+              $(pkg-config --libs wayland-client libjpeg libwebp libwebpdemux libtiff-4 libjxl libavcodec libavformat libavutil libswscale) \
               -lm
           '';
 
@@ -119,6 +120,7 @@
             wayland
             wayland-protocols
             wayland-scanner
+            libjpeg
             libwebp
             libtiff
             libjxl
@@ -5,6 +5,7 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <time.h>
@@ -42,6 +43,14 @@ typedef enum
     WW_MODE_TILE,
 } ww_scale_mode_t;
 
+typedef enum 
+{
+    WW_FILTER_BILINEAR = 0,
+    WW_FILTER_BICUBIC,
+    WW_FILTER_BOX,
+    WW_FILTER_LANCZOS3,
+} ww_filter_t;
+
 typedef enum 
 {
     WW_TRANSITION_NONE = 0,
@@ -81,9 +90,31 @@ typedef struct
     ww_transition_type_t transition;
     float transition_duration;
     int transition_fps;
+    bool progressive;
 } ww_config_t;
 
+typedef enum 
+{
+    WW_PIXEL_RGBA = 0,      // bytes R, G, B, A
+    WW_PIXEL_BGRA,          // bytes B, G, R, A
+} ww_pixel_format_t;
+
+// Decoded pixels. An image either owns its pixel buffer or is a view of a
+// rectangle of another image's pixels, in which case it holds a reference
+// on that image; rows are stride bytes apart either way. Images are
+// refcounted, so one decode can be shared by several outputs and renders.
 typedef struct image_data_t image_data_t;
+struct image_data_t 
+{
+    uint8_t *data;          // top-left pixel
+    int width, height;
+    int channels;           // always 4
+    size_t stride;
+    ww_pixel_format_t format;
+    int refs;
+    image_data_t *parent;   // owner of the pixels, for a view
+};
+
 typedef struct video_decoder_t video_decoder_t;
 
 // core functions
@@ -96,19 +127,124 @@ int ww_set_wallpaper_no_loop(const ww_config_t *config);
 int ww_list_outputs(ww_output_t **outputs, int *count);
 void ww_dispatch_events(void);
 
+// a whole file mapped read-only; kind names the format in error messages
+typedef struct
+{
+    const uint8_t *data;
+    size_t size;
+} ww_mapped_file_t;
+bool ww_map_file(const char *path, ww_mapped_file_t *file, const char *kind);
+void ww_unmap_file(ww_mapped_file_t *file);
+
 // image loading
 image_data_t *ww_load_image(const char *path, int output_width, int output_height, bool preserve_aspect);
 image_data_t *ww_load_image_mode(const char *path, int output_width, int output_height, int mode, uint32_t bg_color);
-void ww_free_image(image_data_t *img);
+image_data_t *ww_decode_image(const char *path);
+image_data_t *ww_decode_image_scaled(const char *path, int min_width, int min_height);
+int ww_decode_image_into(const char *path, uint8_t *dst, int width, int height, size_t stride, bool bgra);
+int ww_probe_image(const char *path, int *width, int *height);
+image_data_t *ww_decode_preview(const char *path, int width, int height, bool *full);
+image_data_t *ww_render_image(image_data_t *img, int output_width, int output_height, int mode, uint32_t bg_color);
+// redraw the part of dst, a render of img, that the rect (*x, *y, *width,
+// *height) of img affects; the rect comes back as the part of dst redrawn
+int ww_render_rect(image_data_t *img, image_data_t *dst, int mode, uint32_t bg_color,
+                   int *x, int *y, int *width, int *height);
+// render a file at several output sizes at once
+typedef struct 
+{
+    int width, height;
+    image_data_t *img;      // the result
+} ww_render_target_t;
+int ww_render_file(const char *path, int mode, uint32_t bg_color,
+                   ww_render_target_t *targets, int count);
+void ww_render_source_size(int image_width, int image_height, int output_width, int output_height,
+                           int mode, int *width, int *height);
+image_data_t *ww_alloc_image(int width, int height);
+image_data_t *ww_ref_image(image_data_t *img);
+image_data_t *ww_view_image(image_data_t *img, int x, int y, int width, int height);
+void ww_free_image(image_data_t *img);    // drops a reference
+
+// image scaling: RGBA to RGBA, strides in bytes
+int ww_scale_rgba(const uint8_t *src, int src_width, int src_height, size_t src_stride,
+                  uint8_t *dst, int dst_width, int dst_height, size_t dst_stride,
+                  ww_filter_t filter);
+// same, but dst is the window at (crop_x, crop_y) of the image scaled to
+// scaled_width x scaled_height
+int ww_scale_rgba_crop(const uint8_t *src, int src_width, int src_height, size_t src_stride,
+                       int scaled_width, int scaled_height, int crop_x, int crop_y,
+                       uint8_t *dst, int dst_width, int dst_height, size_t dst_stride,
+                       ww_filter_t filter);
+// same again, but src holds only the window_width x window_height pixels
+// at (window_x, window_y) of the src_width x src_height image; the window
+// must cover what ww_scale_source_rect gives for the rest of the arguments
+int ww_scale_rgba_window(const uint8_t *src, int src_width, int src_height, size_t src_stride,
+                         int window_x, int window_y, int window_width, int window_height,
+                         int scaled_width, int scaled_height, int crop_x, int crop_y,
+                         uint8_t *dst, int dst_width, int dst_height, size_t dst_stride,
+                         ww_filter_t filter);
+int ww_scale_source_rect(int src_width, int src_height, int scaled_width, int scaled_height,
+                         int crop_x, int crop_y, int dst_width, int dst_height, ww_filter_t filter,
+                         int *x, int *y, int *width, int *height);
+// the rect of dst that reads from the source rect (*x, *y, *width, *height)
+int ww_scale_dest_rect(int src_width, int src_height, int scaled_width, int scaled_height,
+                       int crop_x, int crop_y, int dst_width, int dst_height, ww_filter_t filter,
+                       int *x, int *y, int *width, int *height);
+// the windowed scale, fed a row of the window at a time by a decoder, top
+// to bottom
+typedef struct ww_scale_stream ww_scale_stream;
+ww_scale_stream *ww_scale_stream_create(int src_width, int src_height,
+                                        int window_x, int window_y, int window_width, int window_height,
+                                        int scaled_width, int scaled_height, int crop_x, int crop_y,
+                                        uint8_t *dst, int dst_width, int dst_height, size_t dst_stride,
+                                        ww_filter_t filter);
+void ww_scale_stream_push(ww_scale_stream *stream, const uint8_t *row);
+bool ww_scale_stream_done(const ww_scale_stream *stream);
+void ww_scale_stream_destroy(ww_scale_stream *stream);
+// fill pixels with a 0xRRGGBBAA colour
+void ww_fill_rgba(uint8_t *dst, size_t pixels, uint32_t color);
+// copy pixels swapping red and blue; dst may be src
+void ww_swizzle_rgba(uint8_t *dst, const uint8_t *src, size_t pixels);
+// keep the high bytes of 16-bit big-endian RGBA
+void ww_narrow_rgba16be(uint8_t *dst, const uint8_t *src, size_t pixels);
 
-// video decoder
-video_decoder_t *ww_video_create(const char *path, int target_width, int target_height, bool loop);
+// video decoder; GIFs and animated WebPs are played by the engines below
+video_decoder_t *ww_video_create(const char *path, int target_width, int target_height,
+                                 int mode, uint32_t bg_color, bool loop);
 image_data_t *ww_video_next_frame(video_decoder_t *decoder);
+// the frame to show now: *seq numbers the frame the caller shows, 0 for
+// none yet. 1 and a new reference in *frame (and *seq updated) when a
+// newer one is ready, 0 when the caller's is still current, -1 when
+// playback is over or failed. Never waits, except for a first frame.
+int ww_video_frame(video_decoder_t *decoder, uint64_t *seq, image_data_t **frame);
+// the part of frame seq that differs from frame since, in output pixels;
+// false when that is not known and the whole frame has to be redrawn
+bool ww_video_damage(video_decoder_t *decoder, uint64_t since, uint64_t seq,
+                     int *x, int *y, int *width, int *height);
 double ww_video_get_frame_duration(video_decoder_t *decoder);
 bool ww_video_is_eof(video_decoder_t *decoder);
 void ww_video_seek_start(video_decoder_t *decoder);
 void ww_video_destroy(video_decoder_t *decoder);
 
+// animated WebP: every frame rendered to the output size once, and kept
+// when they all fit; frames are picked by their timestamps
+typedef struct ww_anim ww_anim;
+bool ww_anim_probe(const char *path);
+ww_anim *ww_anim_create(const char *path, int output_width, int output_height,
+                        int mode, uint32_t bg_color, bool loop);
+int ww_anim_frame(ww_anim *anim, uint64_t *seq, image_data_t **frame);
+void ww_anim_destroy(ww_anim *anim);
+
+// GIF: frames kept as palette indices for the rectangle each one changes,
+// and only what changed is redrawn
+typedef struct ww_gif ww_gif;
+bool ww_gif_probe(const char *path);
+ww_gif *ww_gif_create(const char *path, int output_width, int output_height,
+                      int mode, uint32_t bg_color, bool loop);
+int ww_gif_frame(ww_gif *gif, uint64_t *seq, image_data_t **frame);
+bool ww_gif_damage(ww_gif *gif, uint64_t since, uint64_t seq,
+                   int *x, int *y, int *width, int *height);
+void ww_gif_destroy(ww_gif *gif);
+
 typedef struct ww_transition_state ww_transition_state;
 
 ww_transition_state *ww_transition_create(ww_transition_type_t type, float duration,
@@ -120,6 +256,15 @@ bool ww_transition_update(ww_transition_state *state, float delta_time, uint8_t
 bool ww_transition_is_active(const ww_transition_state *state);
 float ww_transition_get_progress(const ww_transition_state *state);
 
+// worker pool: fn runs once per index in [0, count), spread over the
+// pool's threads; thread_id is in [0, ww_parallel_threads())
+typedef void (*ww_parallel_fn)(void *ctx, int index, int thread_id);
+
+void ww_parallel_for(int count, ww_parallel_fn fn, void *ctx);
+int ww_parallel_threads(void);
+void ww_set_max_threads(int count);   // 0: one per usable CPU
+void ww_parallel_shutdown(void);
+
 typedef struct 
 {
     char **paths;
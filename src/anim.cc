@@ -0,0 +1,258 @@
+#include "ww.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <time.h>
+
+#include <webp/decode.h>
+#include <webp/demux.h>
+
+// Animated WebP playback. WebPAnimDecoder does the compositing (blending,
+// disposal) and hands back whole canvases, which are rendered to the output
+// size once each. When every rendered frame fits in WW_ANIM_CACHE_BYTES
+// they are all kept, and after the first pass through the file the decoder
+// and the file itself are dropped: later loops only pick a cached frame. A
+// longer or bigger animation is decoded again on every loop instead, and
+// only the frames actually shown are rendered.
+//
+// Frames are chosen by the clock, not by counting calls: each frame has
+// the end timestamp libwebp gives it, and the one on screen is the one
+// whose span holds the time since playback started. A slow caller skips
+// frames rather than slowing the animation down.
+
+#define WW_ANIM_CACHE_BYTES ((size_t)256 << 20)
+
+extern void set_error(const char *msg);
+
+struct ww_anim
+{
+    ww_mapped_file_t file;
+    WebPAnimDecoder *decoder;   // null once every frame is cached
+    int canvas_width, canvas_height;
+    int output_width, output_height;
+    int mode;
+    uint32_t bg_color;
+    bool loop;
+
+    int frame_count;
+    int *end_ms;                // end timestamp of each frame
+    int decoded;                // frames decoded in the decoder's current pass
+    bool timed;                 // the first pass is done and end_ms complete
+    int total_ms;               // length of one loop, once timed
+    image_data_t **frames;      // rendered frames, when they are all kept
+
+    bool started;
+    struct timespec start;
+};
+
+// Just enough of the file to tell an animation from a still picture
+bool ww_anim_probe(const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        return false;
+    }
+    uint8_t header[64];
+    size_t size = fread(header, 1, sizeof(header), fp);
+    fclose(fp);
+
+    WebPBitstreamFeatures features;
+    return WebPGetFeatures(header, size, &features) != VP8_STATUS_NOT_ENOUGH_DATA &&
+           features.has_animation;
+}
+
+void ww_anim_destroy(struct ww_anim *anim) {
+    if (!anim) {
+        return;
+    }
+    if (anim->decoder) {
+        WebPAnimDecoderDelete(anim->decoder);
+    }
+    ww_unmap_file(&anim->file);
+    if (anim->frames) {
+        for (int i = 0; i < anim->frame_count; i++) {
+            ww_free_image(anim->frames[i]);
+        }
+        free(anim->frames);
+    }
+    free(anim->end_ms);
+    free(anim);
+}
+
+struct ww_anim *ww_anim_create(const char *path, int output_width, int output_height,
+                               int mode, uint32_t bg_color, bool loop) {
+    struct ww_anim *anim = (struct ww_anim*)calloc(1, sizeof(struct ww_anim));
+    if (!anim) {
+        set_error("Out of memory");
+        return nullptr;
+    }
+    anim->output_width = output_width;
+    anim->output_height = output_height;
+    anim->mode = mode;
+    anim->bg_color = bg_color;
+    anim->loop = loop;
+
+    if (!ww_map_file(path, &anim->file, "WebP")) {
+        set_error("Failed to open animated WebP");
+        ww_anim_destroy(anim);
+        return nullptr;
+    }
+
+    WebPAnimDecoderOptions options;
+    if (!WebPAnimDecoderOptionsInit(&options)) {
+        set_error("libwebp version mismatch");
+        ww_anim_destroy(anim);
+        return nullptr;
+    }
+    options.color_mode = MODE_RGBA;
+    options.use_threads = ww_parallel_threads() > 1;
+
+    WebPData data = { anim->file.data, anim->file.size };
+    anim->decoder = WebPAnimDecoderNew(&data, &options);
+    WebPAnimInfo info;
+    if (!anim->decoder || !WebPAnimDecoderGetInfo(anim->decoder, &info) || info.frame_count == 0) {
+        set_error("Failed to decode animated WebP");
+        ww_anim_destroy(anim);
+        return nullptr;
+    }
+    anim->canvas_width = (int)info.canvas_width;
+    anim->canvas_height = (int)info.canvas_height;
+    anim->frame_count = (int)info.frame_count;
+
+    anim->end_ms = (int*)calloc(anim->frame_count, sizeof(int));
+    if (!anim->end_ms) {
+        set_error("Out of memory");
+        ww_anim_destroy(anim);
+        return nullptr;
+    }
+
+    size_t frame_bytes = (size_t)output_width * output_height * 4;
+    if (frame_bytes && (size_t)anim->frame_count <= WW_ANIM_CACHE_BYTES / frame_bytes) {
+        anim->frames = (image_data_t**)calloc(anim->frame_count, sizeof(image_data_t*));
+    }
+    return anim;
+}
+
+// Render the canvas the decoder just produced. The canvas is the
+// decoder's and changes with the next frame, so it is copied first: the
+// render may share the pixels it is given.
+static image_data_t *render_canvas(struct ww_anim *anim, const uint8_t *canvas) {
+    image_data_t *img = ww_alloc_image(anim->canvas_width, anim->canvas_height);
+    if (!img) {
+        return nullptr;
+    }
+    for (int y = 0; y < anim->canvas_height; y++) {
+        memcpy(img->data + img->stride * y, canvas + (size_t)anim->canvas_width * 4 * y,
+               (size_t)anim->canvas_width * 4);
+    }
+    image_data_t *frame = ww_render_image(img, anim->output_width, anim->output_height,
+                                          anim->mode, anim->bg_color);
+    ww_free_image(img);
+    return frame;
+}
+
+// Decode forward to the frame due at t ms into the loop: the first one at
+// or after index that ends later than t. The pass starts over if the
+// decoder is already past index. Frames on the way are composited but only
+// rendered when they are being cached.
+static image_data_t *decode_frame(struct ww_anim *anim, int *index, long long t) {
+    if (anim->decoded > *index) {
+        WebPAnimDecoderReset(anim->decoder);
+        anim->decoded = 0;
+    }
+
+    int last = anim->frame_count - 1;
+    image_data_t *frame = nullptr;
+    while (true) {
+        uint8_t *canvas;
+        int timestamp;
+        if (!WebPAnimDecoderGetNext(anim->decoder, &canvas, &timestamp)) {
+            set_error("Failed to decode animated WebP frame");
+            return nullptr;
+        }
+
+        int i = anim->decoded++;
+        anim->end_ms[i] = timestamp;
+        bool due = i >= *index && (timestamp > t || i == last);
+        if (anim->frames && !anim->frames[i]) {
+            anim->frames[i] = render_canvas(anim, canvas);
+            if (!anim->frames[i]) {
+                return nullptr;
+            }
+        } else if (due) {
+            frame = render_canvas(anim, canvas);
+        }
+        if (due) {
+            *index = i;
+            break;
+        }
+    }
+
+    if (anim->decoded == anim->frame_count) {
+        anim->timed = true;
+        anim->total_ms = anim->end_ms[last];
+    }
+
+    // Every frame is rendered and kept: the file has nothing more to give
+    if (anim->frames && anim->decoded == anim->frame_count) {
+        WebPAnimDecoderDelete(anim->decoder);
+        anim->decoder = nullptr;
+        ww_unmap_file(&anim->file);
+    }
+    return anim->frames ? ww_ref_image(anim->frames[*index]) : frame;
+}
+
+// The frame due now, as for ww_video_frame()
+int ww_anim_frame(struct ww_anim *anim, uint64_t *seq, image_data_t **frame) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (!anim->started) {
+        anim->start = now;
+        anim->started = true;
+    }
+    long long elapsed = (long long)(now.tv_sec - anim->start.tv_sec) * 1000 +
+                        (now.tv_nsec - anim->start.tv_nsec) / 1000000;
+
+    int last = anim->frame_count - 1;
+    bool over = false;
+    long long loop = 0, t = elapsed;
+    if (anim->timed) {
+        if (anim->total_ms <= 0 || (!anim->loop && elapsed >= anim->total_ms)) {
+            over = true;
+        } else {
+            loop = elapsed / anim->total_ms;
+            t = elapsed % anim->total_ms;
+        }
+    }
+
+    // The first frame ending after t, among those decoded so far; during
+    // the first pass it may lie further on, and decoding finds it
+    int index = 0;
+    int known = anim->timed ? anim->frame_count : anim->decoded;
+    if (over) {
+        index = last;
+    } else {
+        while (index < known && index < last && anim->end_ms[index] <= t) {
+            index++;
+        }
+    }
+
+    if (index < known) {
+        uint64_t due = (uint64_t)loop * anim->frame_count + index + 1;
+        if (*seq == due) {
+            return over ? -1 : 0;
+        }
+    }
+
+    image_data_t *img;
+    if (anim->frames && index < known && anim->frames[index]) {
+        img = ww_ref_image(anim->frames[index]);
+    } else {
+        img = decode_frame(anim, &index, t);
+    }
+    if (!img) {
+        return -1;
+    }
+    *seq = (uint64_t)loop * anim->frame_count + index + 1;
+    *frame = img;
+    return 1;
+}
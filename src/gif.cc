@@ -0,0 +1,645 @@
+#include "ww.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <time.h>
+
+// GIF playback. The whole file is decoded up front, but each frame is kept
+// the way GIF stores it: palette indices for just the rectangle it
+// changes, a quarter of the size of RGBA for that rectangle and usually
+// far less than a whole frame. Playing a frame composites that rectangle
+// onto an RGBA canvas, redraws only the part of the output-sized render it
+// reaches and reports that part as damage, so small animations cost next
+// to nothing per frame however often they loop.
+//
+// Frames are picked by the clock like the animated WebP engine does, from
+// the GIF's own delays.
+
+#define WW_GIF_MAX_BYTES ((size_t)256 << 20)   // indices kept, all frames together
+#define WW_GIF_HISTORY 8                       // frame changes remembered for damage
+
+extern void set_error(const char *msg);
+
+enum {
+    GIF_DISPOSE_NONE = 1,           // leave the frame in place
+    GIF_DISPOSE_BACKGROUND = 2,     // clear its rectangle
+    GIF_DISPOSE_PREVIOUS = 3,       // put back what was there before it
+};
+
+struct gif_frame
+{
+    int x, y, width, height;
+    uint8_t *pixels;            // palette indices, width x height
+    const uint32_t *palette;    // 256 RGBA pixels, the global table or its own
+    bool own_palette;
+    int transparent;            // palette index, or -1
+    int disposal;
+    int end_ms;                 // end of the frame, from the start of the loop
+};
+
+// A change of the render from one frame to another
+struct gif_damage
+{
+    uint64_t from, to;
+    int x, y, width, height;
+};
+
+struct ww_gif
+{
+    int width, height;          // the logical screen
+    int frame_count;
+    struct gif_frame *frames;
+    uint32_t *global_palette;
+    int total_ms;
+
+    int output_width, output_height;
+    int mode;
+    uint32_t bg_color;          // where nothing has been drawn, or a frame cleared
+    bool loop;
+
+    image_data_t *canvas;       // the screen with frames composited so far
+    image_data_t *render;       // canvas rendered to the output size
+    uint8_t *saved;             // under a frame that disposes to previous
+    int current;                // frame on the canvas, -1 before the first
+    int painted[4];             // box (x0, y0, x1, y1) drawn over since the canvas was clear
+    uint64_t seq;               // number of that frame, as ww_video_frame() counts
+
+    struct gif_damage damage[WW_GIF_HISTORY];
+    int damage_next;
+
+    bool started;
+    struct timespec start;
+};
+
+// ============================================================================
+// Decoding
+// ============================================================================
+
+static int read_u16(const uint8_t *p) {
+    return p[0] | (p[1] << 8);
+}
+
+// Skip a run of data sub-blocks, up to and including the empty one that
+// ends it
+static const uint8_t *skip_blocks(const uint8_t *pos, const uint8_t *end) {
+    while (pos < end) {
+        int size = *pos++;
+        if (size == 0) {
+            return pos;
+        }
+        pos += size;
+    }
+    return nullptr;
+}
+
+static uint32_t *read_palette(const uint8_t *pos, int entries) {
+    uint32_t *palette = (uint32_t*)calloc(256, sizeof(uint32_t));
+    if (!palette) {
+        return nullptr;
+    }
+    for (int i = 0; i < entries; i++) {
+        uint8_t rgba[4] = { pos[i * 3], pos[i * 3 + 1], pos[i * 3 + 2], 255 };
+        memcpy(&palette[i], rgba, 4);
+    }
+    return palette;
+}
+
+// LZW codes, least significant bit first, read across the sub-blocks of
+// an image's data
+struct gif_bits
+{
+    const uint8_t *pos, *end;
+    int block_left;             // bytes left in the current sub-block
+    bool ended;                 // the empty sub-block has been read
+    uint32_t buffer;
+    int count;
+};
+
+static int read_code(struct gif_bits *bits, int size) {
+    while (bits->count < size) {
+        if (bits->block_left == 0) {
+            if (bits->ended || bits->pos >= bits->end) {
+                return -1;
+            }
+            bits->block_left = *bits->pos++;
+            if (bits->block_left == 0) {
+                bits->ended = true;
+                return -1;
+            }
+        }
+        if (bits->pos >= bits->end) {
+            return -1;
+        }
+        bits->buffer |= (uint32_t)*bits->pos++ << bits->count;
+        bits->count += 8;
+        bits->block_left--;
+    }
+    int code = bits->buffer & ((1u << size) - 1);
+    bits->buffer >>= size;
+    bits->count -= size;
+    return code;
+}
+
+// Decode an image's LZW data into out. Data that stops short leaves the
+// rest of out at index 0, as most decoders do. Returns where the data ends.
+static const uint8_t *decode_lzw(const uint8_t *pos, const uint8_t *end, int min_size,
+                                 uint8_t *out, size_t out_size) {
+    static thread_local uint16_t prefix[4096];
+    static thread_local uint8_t suffix[4096];
+    static thread_local uint8_t stack[4096];
+
+    int clear = 1 << min_size;
+    int size = min_size + 1;
+    int next = clear + 2;
+    int prev = -1;
+    uint8_t first = 0;
+    size_t written = 0;
+    for (int i = 0; i < clear; i++) {
+        prefix[i] = 0;
+        suffix[i] = (uint8_t)i;
+    }
+
+    struct gif_bits bits = { pos, end, 0, false, 0, 0 };
+    while (written < out_size) {
+        int code = read_code(&bits, size);
+        if (code < 0 || code == clear + 1) {
+            break;
+        }
+        if (code == clear) {
+            size = min_size + 1;
+            next = clear + 2;
+            prev = -1;
+            continue;
+        }
+        if (prev < 0) {
+            if (code >= clear) {
+                break;
+            }
+            first = (uint8_t)code;
+            out[written++] = first;
+            prev = code;
+            continue;
+        }
+        if (code > next) {
+            break;
+        }
+
+        // Walk the chain back to its root; a code not in the table yet is
+        // the previous string plus its own first byte
+        int in = code;
+        int depth = 0;
+        if (code == next) {
+            stack[depth++] = first;
+            code = prev;
+        }
+        while (code >= clear) {
+            stack[depth++] = suffix[code];
+            code = prefix[code];
+        }
+        stack[depth++] = (uint8_t)code;
+        first = (uint8_t)code;
+
+        if (next < 4096) {
+            prefix[next] = (uint16_t)prev;
+            suffix[next] = first;
+            next++;
+            if (next == (1 << size) && size < 12) {
+                size++;
+            }
+        }
+        while (depth > 0 && written < out_size) {
+            out[written++] = stack[--depth];
+        }
+        prev = in;
+    }
+
+    // Whatever is left of the data, if anything
+    if (bits.ended) {
+        return bits.pos;
+    }
+    return skip_blocks(bits.pos + bits.block_left, end);
+}
+
+// Interlaced images store every 8th row from 0, every 8th from 4, every
+// 4th from 2, then every 2nd from 1
+static void deinterlace(uint8_t *dst, const uint8_t *src, int width, int height) {
+    static const int first[4] = { 0, 4, 2, 1 };
+    static const int step[4] = { 8, 8, 4, 2 };
+    int row = 0;
+    for (int pass = 0; pass < 4; pass++) {
+        for (int y = first[pass]; y < height; y += step[pass]) {
+            memcpy(dst + (size_t)y * width, src + (size_t)row++ * width, width);
+        }
+    }
+}
+
+static void free_frames(struct ww_gif *gif) {
+    for (int i = 0; i < gif->frame_count; i++) {
+        free(gif->frames[i].pixels);
+        if (gif->frames[i].own_palette) {
+            free((void*)gif->frames[i].palette);
+        }
+    }
+    free(gif->frames);
+    free(gif->global_palette);
+}
+
+// Read every frame of the file into gif. Delays of 0 or 10 ms get 100 ms,
+// as browsers give them.
+static bool parse_gif(struct ww_gif *gif, const uint8_t *data, size_t size) {
+    const uint8_t *pos = data;
+    const uint8_t *end = data + size;
+    if (size < 13 || (memcmp(data, "GIF87a", 6) != 0 && memcmp(data, "GIF89a", 6) != 0)) {
+        fprintf(stderr, "Not a GIF file\n");
+        return false;
+    }
+    gif->width = read_u16(data + 6);
+    gif->height = read_u16(data + 8);
+    int flags = data[10];
+    pos += 13;
+    if (gif->width == 0 || gif->height == 0) {
+        fprintf(stderr, "GIF has no size\n");
+        return false;
+    }
+
+    if (flags & 0x80) {
+        int entries = 2 << (flags & 7);
+        if (end - pos < entries * 3) {
+            return false;
+        }
+        gif->global_palette = read_palette(pos, entries);
+        if (!gif->global_palette) {
+            return false;
+        }
+        pos += entries * 3;
+    }
+
+    int capacity = 0;
+    size_t kept = 0;
+    int disposal = 0, delay = 0, transparent = -1;
+    int time_ms = 0;
+    while (pos && pos < end) {
+        int block = *pos++;
+        if (block == 0x3B) {
+            break;
+        }
+
+        if (block == 0x21) {
+            if (end - pos < 1) {
+                break;
+            }
+            int label = *pos++;
+            // Graphic control: how the next image is timed, disposed and keyed
+            if (label == 0xF9 && end - pos >= 6 && pos[0] == 4) {
+                disposal = (pos[1] >> 2) & 7;
+                delay = read_u16(pos + 2);
+                transparent = (pos[1] & 1) ? pos[4] : -1;
+            }
+            pos = skip_blocks(pos, end);
+            continue;
+        }
+
+        if (block != 0x2C || end - pos < 10) {
+            break;
+        }
+
+        if (gif->frame_count == capacity) {
+            int grown = capacity ? capacity * 2 : 16;
+            struct gif_frame *frames = (struct gif_frame*)realloc(gif->frames, grown * sizeof(*frames));
+            if (!frames) {
+                return false;
+            }
+            gif->frames = frames;
+            capacity = grown;
+        }
+        struct gif_frame *frame = &gif->frames[gif->frame_count];
+        memset(frame, 0, sizeof(*frame));
+        frame->x = read_u16(pos);
+        frame->y = read_u16(pos + 2);
+        frame->width = read_u16(pos + 4);
+        frame->height = read_u16(pos + 6);
+        int image_flags = pos[8];
+        pos += 9;
+        gif->frame_count++;
+
+        frame->palette = gif->global_palette;
+        if (image_flags & 0x80) {
+            int entries = 2 << (image_flags & 7);
+            if (end - pos < entries * 3) {
+                return false;
+            }
+            frame->palette = read_palette(pos, entries);
+            if (!frame->palette) {
+                return false;
+            }
+            frame->own_palette = true;
+            pos += entries * 3;
+        }
+        frame->transparent = transparent;
+        frame->disposal = disposal;
+        time_ms += delay <= 1 ? 100 : delay * 10;
+        frame->end_ms = time_ms;
+        disposal = 0;
+        delay = 0;
+        transparent = -1;
+
+        size_t pixel_count = (size_t)frame->width * frame->height;
+        kept += pixel_count;
+        if (!frame->palette || pixel_count == 0 || end - pos < 1 || kept > WW_GIF_MAX_BYTES) {
+            if (kept > WW_GIF_MAX_BYTES) {
+                fprintf(stderr, "GIF too large to keep decoded\n");
+            }
+            return false;
+        }
+        int min_size = *pos++;
+        frame->pixels = (uint8_t*)calloc(pixel_count, 1);
+        uint8_t *linear = (image_flags & 0x40) ? (uint8_t*)calloc(pixel_count, 1) : frame->pixels;
+        if (!frame->pixels || !linear || min_size < 1 || min_size > 8) {
+            if (linear != frame->pixels) {
+                free(linear);
+            }
+            return false;
+        }
+        pos = decode_lzw(pos, end, min_size, linear, pixel_count);
+        if (linear != frame->pixels) {
+            deinterlace(frame->pixels, linear, frame->width, frame->height);
+            free(linear);
+        }
+    }
+
+    if (gif->frame_count == 0) {
+        fprintf(stderr, "GIF has no frames\n");
+        return false;
+    }
+    gif->total_ms = time_ms;
+    return true;
+}
+
+// ============================================================================
+// Playback
+// ============================================================================
+
+// A frame's rectangle, clipped to the screen
+static bool frame_rect(const struct ww_gif *gif, const struct gif_frame *frame,
+                       int *x0, int *y0, int *x1, int *y1) {
+    *x0 = frame->x < gif->width ? frame->x : gif->width;
+    *y0 = frame->y < gif->height ? frame->y : gif->height;
+    *x1 = frame->x + frame->width < gif->width ? frame->x + frame->width : gif->width;
+    *y1 = frame->y + frame->height < gif->height ? frame->y + frame->height : gif->height;
+    return *x0 < *x1 && *y0 < *y1;
+}
+
+static void grow_rect(int *dirty, int x0, int y0, int x1, int y1) {
+    if (dirty[0] >= dirty[2]) {
+        dirty[0] = x0;
+        dirty[1] = y0;
+        dirty[2] = x1;
+        dirty[3] = y1;
+        return;
+    }
+    dirty[0] = x0 < dirty[0] ? x0 : dirty[0];
+    dirty[1] = y0 < dirty[1] ? y0 : dirty[1];
+    dirty[2] = x1 > dirty[2] ? x1 : dirty[2];
+    dirty[3] = y1 > dirty[3] ? y1 : dirty[3];
+}
+
+// Composite frame index onto the canvas after the one before it, growing
+// dirty (x0, y0, x1, y1) by whatever changes
+static void draw_frame(struct ww_gif *gif, int index, int *dirty) {
+    image_data_t *canvas = gif->canvas;
+    int x0, y0, x1, y1;
+
+    // The previous frame leaves first, the way it asked to
+    if (index > 0) {
+        const struct gif_frame *prev = &gif->frames[index - 1];
+        if ((prev->disposal == GIF_DISPOSE_BACKGROUND || prev->disposal == GIF_DISPOSE_PREVIOUS) &&
+            frame_rect(gif, prev, &x0, &y0, &x1, &y1)) {
+            for (int y = y0; y < y1; y++) {
+                uint8_t *row = canvas->data + canvas->stride * y + (size_t)x0 * 4;
+                size_t bytes = (size_t)(x1 - x0) * 4;
+                if (prev->disposal == GIF_DISPOSE_PREVIOUS) {
+                    memcpy(row, gif->saved + bytes * (y - y0), bytes);
+                } else {
+                    ww_fill_rgba(row, x1 - x0, gif->bg_color);
+                }
+            }
+            grow_rect(dirty, x0, y0, x1, y1);
+        }
+    }
+
+    const struct gif_frame *frame = &gif->frames[index];
+    if (!frame_rect(gif, frame, &x0, &y0, &x1, &y1)) {
+        return;
+    }
+    if (frame->disposal == GIF_DISPOSE_PREVIOUS) {
+        size_t bytes = (size_t)(x1 - x0) * 4;
+        for (int y = y0; y < y1; y++) {
+            memcpy(gif->saved + bytes * (y - y0),
+                   canvas->data + canvas->stride * y + (size_t)x0 * 4, bytes);
+        }
+    }
+
+    grow_rect(gif->painted, x0, y0, x1, y1);
+
+    // Expand the indices; transparent ones leave the canvas showing
+    for (int y = y0; y < y1; y++) {
+        const uint8_t *src = frame->pixels + (size_t)(y - frame->y) * frame->width + (x0 - frame->x);
+        uint32_t *dst = (uint32_t*)(canvas->data + canvas->stride * y) + x0;
+        for (int x = 0; x < x1 - x0; x++) {
+            if (src[x] != frame->transparent) {
+                dst[x] = frame->palette[src[x]];
+            }
+        }
+    }
+    grow_rect(dirty, x0, y0, x1, y1);
+}
+
+bool ww_gif_probe(const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        return false;
+    }
+    char header[6];
+    bool ok = fread(header, 1, sizeof(header), fp) == sizeof(header) &&
+              (memcmp(header, "GIF87a", 6) == 0 || memcmp(header, "GIF89a", 6) == 0);
+    fclose(fp);
+    return ok;
+}
+
+void ww_gif_destroy(struct ww_gif *gif) {
+    if (!gif) {
+        return;
+    }
+    free_frames(gif);
+    ww_free_image(gif->canvas);
+    ww_free_image(gif->render);
+    free(gif->saved);
+    free(gif);
+}
+
+struct ww_gif *ww_gif_create(const char *path, int output_width, int output_height,
+                             int mode, uint32_t bg_color, bool loop) {
+    struct ww_gif *gif = (struct ww_gif*)calloc(1, sizeof(struct ww_gif));
+    if (!gif) {
+        set_error("Out of memory");
+        return nullptr;
+    }
+    gif->output_width = output_width;
+    gif->output_height = output_height;
+    gif->mode = mode;
+    gif->bg_color = bg_color;
+    gif->loop = loop;
+    gif->current = -1;
+
+    ww_mapped_file_t file = {};
+    if (!ww_map_file(path, &file, "GIF")) {
+        set_error("Failed to open GIF");
+        free(gif);
+        return nullptr;
+    }
+    bool parsed = parse_gif(gif, file.data, file.size);
+    ww_unmap_file(&file);
+    if (!parsed) {
+        set_error("Failed to decode GIF");
+        ww_gif_destroy(gif);
+        return nullptr;
+    }
+
+    bool restores = false;
+    for (int i = 0; i < gif->frame_count; i++) {
+        restores |= gif->frames[i].disposal == GIF_DISPOSE_PREVIOUS;
+    }
+    gif->canvas = ww_alloc_image(gif->width, gif->height);
+    gif->render = ww_alloc_image(output_width, output_height);
+    gif->saved = restores ? (uint8_t*)malloc((size_t)gif->width * gif->height * 4) : nullptr;
+    if (!gif->canvas || !gif->render || (restores && !gif->saved)) {
+        set_error("Out of memory");
+        ww_gif_destroy(gif);
+        return nullptr;
+    }
+    return gif;
+}
+
+// The frame due now, as for ww_video_frame()
+int ww_gif_frame(struct ww_gif *gif, uint64_t *seq, image_data_t **frame) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (!gif->started) {
+        gif->start = now;
+        gif->started = true;
+    }
+    long long elapsed = (long long)(now.tv_sec - gif->start.tv_sec) * 1000 +
+                        (now.tv_nsec - gif->start.tv_nsec) / 1000000;
+
+    // A single frame is a still picture, whatever its delay says
+    int last = gif->frame_count - 1;
+    bool over = (!gif->loop || last == 0) && elapsed >= gif->total_ms;
+    long long loop = over ? 0 : elapsed / gif->total_ms;
+    long long t = elapsed % gif->total_ms;
+    int index = last;
+    if (!over) {
+        index = 0;
+        while (index < last && gif->frames[index].end_ms <= t) {
+            index++;
+        }
+    }
+
+    uint64_t due = (uint64_t)loop * gif->frame_count + index + 1;
+    if (due != gif->seq) {
+        // The canvas only moves forward; an earlier frame, or the next loop,
+        // starts again from a clear screen. Only what was drawn over needs
+        // clearing.
+        int dirty[4] = { 0, 0, 0, 0 };
+        int from = gif->current + 1;
+        if (gif->current < 0) {
+            ww_fill_rgba(gif->canvas->data, (size_t)gif->width * gif->height, gif->bg_color);
+            grow_rect(dirty, 0, 0, gif->width, gif->height);
+            from = 0;
+        } else if (index <= gif->current) {
+            int *box = gif->painted;
+            for (int y = box[1]; y < box[3]; y++) {
+                ww_fill_rgba(gif->canvas->data + gif->canvas->stride * y + (size_t)box[0] * 4,
+                             box[2] - box[0], gif->bg_color);
+            }
+            memcpy(dirty, box, sizeof(dirty));
+            memset(box, 0, sizeof(gif->painted));
+            from = 0;
+        }
+        for (int i = from; i <= index; i++) {
+            draw_frame(gif, i, dirty);
+        }
+        gif->current = index;
+
+        // Someone still holds the last render: draw into a copy of it
+        if (gif->render->refs > 1) {
+            image_data_t *copy = ww_alloc_image(gif->output_width, gif->output_height);
+            if (!copy) {
+                return -1;
+            }
+            memcpy(copy->data, gif->render->data, copy->stride * copy->height);
+            ww_free_image(gif->render);
+            gif->render = copy;
+        }
+
+        int x = dirty[0], y = dirty[1];
+        int width = dirty[2] - dirty[0], height = dirty[3] - dirty[1];
+        if (gif->seq == 0) {
+            // Nothing drawn yet, so all of it, background too
+            x = 0;
+            y = 0;
+            width = gif->width;
+            height = gif->height;
+        }
+        if (ww_render_rect(gif->canvas, gif->render, gif->mode, gif->bg_color,
+                           &x, &y, &width, &height) != 0) {
+            return -1;
+        }
+
+        struct gif_damage *damage = &gif->damage[gif->damage_next];
+        gif->damage_next = (gif->damage_next + 1) % WW_GIF_HISTORY;
+        damage->from = gif->seq;
+        damage->to = due;
+        damage->x = x;
+        damage->y = y;
+        damage->width = width;
+        damage->height = height;
+        gif->seq = due;
+    }
+
+    if (*seq == due) {
+        return over ? -1 : 0;
+    }
+    *seq = due;
+    *frame = ww_ref_image(gif->render);
+    return 1;
+}
+
+// The part of the render that changed between frames since and seq, from
+// the last few changes. False when they do not reach back that far.
+bool ww_gif_damage(struct ww_gif *gif, uint64_t since, uint64_t seq,
+                   int *x, int *y, int *width, int *height) {
+    if (since == 0 || since > seq) {
+        return false;
+    }
+    int box[4] = { 0, 0, 0, 0 };
+    while (seq != since) {
+        const struct gif_damage *found = nullptr;
+        for (int i = 0; i < WW_GIF_HISTORY; i++) {
+            if (gif->damage[i].to == seq) {
+                found = &gif->damage[i];
+            }
+        }
+        if (!found) {
+            return false;
+        }
+        if (found->width > 0 && found->height > 0) {
+            grow_rect(box, found->x, found->y, found->x + found->width, found->y + found->height);
+        }
+        seq = found->from;
+    }
+    *x = box[0];
+    *y = box[1];
+    *width = box[2] - box[0];
+    *height = box[3] - box[1];
+    return true;
+}
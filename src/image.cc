@@ -2,10 +2,18 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <climits>
+#include <cmath>
+#include <csetjmp>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
+#include <jpeglib.h>
 #include <webp/decode.h>
 #include <tiffio.h>
 #include <jxl/decode.h>
@@ -13,727 +21,1790 @@
 
 extern "C" {
 
-struct image_data_t 
-{
-    uint8_t *data;
-    int width, height;
-    int channels;
-};
+static void init_image(image_data_t *img, uint8_t *data, int width, int height) {
+    img->data = data;
+    img->width = width;
+    img->height = height;
+    img->channels = 4;
+    img->stride = (size_t)width * 4;
+    img->format = WW_PIXEL_RGBA;
+    img->refs = 1;
+    img->parent = nullptr;
+}
 
-static image_data_t* load_webp(const char *path) 
-{
-    if (!path)
+// A new RGBA image with packed rows, holding one reference
+image_data_t* ww_alloc_image(int width, int height) {
+    image_data_t *img = (image_data_t*)malloc(sizeof(image_data_t));
+    if (!img) {
         return nullptr;
-
-    FILE *file = fopen(path, "rb");
-    if (!file) {
-        fprintf(stderr, "Failed to open WebP file: %s\n", path);
+    }
+    
+    uint8_t *data = (uint8_t*)malloc((size_t)width * (size_t)height * 4);
+    if (!data) {
+        free(img);
         return nullptr;
     }
+    
+    init_image(img, data, width, height);
+    return img;
+}
 
-    fseek(file, 0, SEEK_END);
-    long file_len = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    // ftell returns -1 on error -- a directory, say. Assigning that to a size_t
-    // made file_size SIZE_MAX, so the malloc below merely "failed" and the user
-    // saw an out-of-memory rather than "not a readable file".
-    if (file_len <= 0) {
-        fprintf(stderr, "Not a readable file: %s\n", path);
-        fclose(file);
-        return nullptr;
+image_data_t* ww_ref_image(image_data_t *img) {
+    if (img) {
+        __atomic_add_fetch(&img->refs, 1, __ATOMIC_RELAXED);
     }
-    size_t file_size = (size_t)file_len;
+    return img;
+}
 
-    uint8_t *file_data = (uint8_t*)malloc(file_size);
-    if (!file_data) {
-        fclose(file);
+// A rectangle of img without copying it. The view keeps img alive, so the
+// caller may drop its own reference straight away.
+image_data_t* ww_view_image(image_data_t *img, int x, int y, int width, int height) {
+    if (!img || x < 0 || y < 0 || width <= 0 || height <= 0 ||
+        x + width > img->width || y + height > img->height) {
         return nullptr;
     }
-
-    size_t read = fread(file_data, 1, file_size, file);
-    fclose(file);
     
-    if (read != file_size) {
-        fprintf(stderr, "Failed to read WebP file\n");
-        free(file_data);
+    image_data_t *view = (image_data_t*)malloc(sizeof(image_data_t));
+    if (!view) {
         return nullptr;
     }
+    
+    *view = *img;
+    view->data = img->data + img->stride * y + (size_t)x * 4;
+    view->width = width;
+    view->height = height;
+    view->refs = 1;
+    // Views of views hang off the owner directly
+    view->parent = ww_ref_image(img->parent ? img->parent : img);
+    return view;
+}
 
-    image_data_t *img = (image_data_t*)malloc(sizeof(image_data_t));
-    if (!img) {
-        free(file_data);
-        return nullptr;
+// Where a loader writes its pixels: a buffer the caller already has, of a
+// known size and row stride (a mapped wl_shm buffer, say), a new image
+// allocated once the loader knows how big it is, or, when streaming, the
+// scalers of a set of renders, a row at a time. Only the JPEG, TIFF and
+// Farbfeld loaders stream; they produce rows through dest_row and
+// dest_put_row. stb only hands over rows when it is the fallback for one
+// of them that failed, and then from a full decode.
+//
+// Given the renders, a loader may also decode just the window of the image
+// they show (see dest_window). width and height are then the window's, and
+// full_width x full_height the whole image's.
+struct decode_dest {
+    uint8_t *data;
+    size_t stride;
+    int width;
+    int height;
+    bool bgra;          // caller wants red and blue swapped
+    bool swapped;       // loader already wrote them swapped
+    bool preview;       // a first progressive pass is enough; cleared
+                        // when the loader decoded the whole image anyway
+    int min_width;      // with no buffer given, the loader may shrink the
+    int min_height;     // image while decoding, down to this size
+    image_data_t *img;  // allocated here when the caller had no buffer
+    
+    ww_render_target_t *targets;    // what the image is decoded for
+    int target_count;
+    int mode;
+    uint32_t bg_color;
+    int x;                          // where the decoded window sits
+    int y;
+    int full_width;
+    int full_height;
+    
+    bool stream;                    // straight into the targets' scalers
+    ww_scale_stream **streams;      // one per target
+    uint8_t *row;                   // the row being decoded
+};
+
+static bool begin_streams(struct decode_dest *dest);
+static void end_streams(struct decode_dest *dest);
+static void render_window(int full_width, int full_height, int output_width, int output_height,
+                          int mode, int *x, int *y, int *width, int *height);
+
+// The part of a width x height image that the renders show, for loaders
+// that can decode a rectangle of it. Everything when there are no renders.
+static void dest_window(const struct decode_dest *dest, int width, int height,
+                        int *x, int *y, int *window_width, int *window_height) {
+    int x0 = 0, y0 = 0, x1 = width, y1 = height;
+    if (dest->targets && !dest->data) {
+        x0 = width;
+        y0 = height;
+        x1 = 0;
+        y1 = 0;
+        for (int t = 0; t < dest->target_count; t++) {
+            int rx, ry, rw, rh;
+            render_window(width, height, dest->targets[t].width, dest->targets[t].height,
+                          dest->mode, &rx, &ry, &rw, &rh);
+            if (rx < x0) x0 = rx;
+            if (ry < y0) y0 = ry;
+            if (rx + rw > x1) x1 = rx + rw;
+            if (ry + rh > y1) y1 = ry + rh;
+        }
     }
+    *x = x0;
+    *y = y0;
+    *window_width = x1 - x0;
+    *window_height = y1 - y0;
+}
 
-    img->data = WebPDecodeRGBA(file_data, file_size, &img->width, &img->height);
-    img->channels = 4;
+static bool dest_begin_window(struct decode_dest *dest, int full_width, int full_height,
+                              int x, int y, int width, int height);
+
+// Called by a loader as soon as it knows the image size
+static bool dest_begin(struct decode_dest *dest, int width, int height) {
+    return dest_begin_window(dest, width, height, 0, 0, width, height);
+}
+
+// The same for a loader decoding only the width x height window at (x, y)
+// of a full_width x full_height image
+static bool dest_begin_window(struct decode_dest *dest, int full_width, int full_height,
+                              int x, int y, int width, int height) {
+    dest->x = x;
+    dest->y = y;
+    dest->full_width = full_width;
+    dest->full_height = full_height;
+    
+    if (dest->data) {
+        if (width != dest->width || height != dest->height) {
+            fprintf(stderr, "Image is %dx%d, expected %dx%d\n",
+                    width, height, dest->width, dest->height);
+            return false;
+        }
+        return true;
+    }
+    
+    // Streaming holds a row of the image, so any size will do
+    if (dest->stream) {
+        if (width <= 0 || height <= 0) {
+            return false;
+        }
+        dest->width = width;
+        dest->height = height;
+        return begin_streams(dest);
+    }
+    
+    // size_t throughout: w * h * 4 in int overflows around 23000x23000, and the
+    // dimensions come from the file, so they are not ours to trust.
+    if (width <= 0 || height <= 0 || (size_t)width * (size_t)height > (size_t)1 << 28) {
+        fprintf(stderr, "Unusable image size %dx%d\n", width, height);
+        return false;
+    }
+    
+    dest->img = ww_alloc_image(width, height);
+    if (!dest->img) {
+        return false;
+    }
+    dest->data = dest->img->data;
+    dest->stride = (size_t)width * 4;
+    dest->width = width;
+    dest->height = height;
+    return true;
+}
+
+// Where to decode row y, to be handed over with dest_put_row
+static uint8_t* dest_row(struct decode_dest *dest, int y) {
+    return dest->stream ? dest->row : dest->data + dest->stride * y;
+}
+
+// Store a finished row, or feed it to the scalers when streaming
+static void dest_put_row(struct decode_dest *dest, int y, const uint8_t *row) {
+    if (dest->stream) {
+        for (int t = 0; t < dest->target_count; t++) {
+            ww_scale_stream_push(dest->streams[t], row);
+        }
+        return;
+    }
+    
+    uint8_t *out = dest->data + dest->stride * y;
+    if (out != row) {
+        memcpy(out, row, (size_t)dest->width * 4);
+    }
+}
 
-    free(file_data);
+// Undo a failed attempt so another loader can have a go
+static void dest_reset(struct decode_dest *dest) {
+    if (dest->stream) {
+        end_streams(dest);
+        for (int t = 0; t < dest->target_count; t++) {
+            ww_free_image(dest->targets[t].img);
+            dest->targets[t].img = nullptr;
+        }
+    }
+    if (dest->img) {
+        ww_free_image(dest->img);
+        dest->img = nullptr;
+        dest->data = nullptr;
+    }
+    dest->swapped = false;
+}
+
+// Map a whole file read-only. The decoders read straight from the page
+// cache instead of from a malloc'd copy of the file. kind names the format
+// in error messages.
+bool ww_map_file(const char *path, ww_mapped_file_t *file, const char *kind) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open %s file: %s\n", kind, path);
+        return false;
+    }
+
+    // Only regular files map; a directory, say, would otherwise surface as
+    // some odd decoder error rather than "not a readable file"
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0) {
+        fprintf(stderr, "Not a readable file: %s\n", path);
+        close(fd);
+        return false;
+    }
+
+    size_t size = (size_t)st.st_size;
+    void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Failed to read %s file\n", kind);
+        return false;
+    }
+
+    // Every loader reads front to back, once: start readahead now and let
+    // the kernel drop pages behind us
+    madvise(data, size, MADV_WILLNEED);
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    file->data = (const uint8_t*)data;
+    file->size = size;
+    return true;
+}
+
+void ww_unmap_file(ww_mapped_file_t *file) {
+    if (file->data) {
+        munmap((void*)file->data, file->size);
+        file->data = nullptr;
+    }
+}
+
+// libjpeg reports errors through error_exit, which must not return
+struct jpeg_error {
+    struct jpeg_error_mgr mgr;
+    jmp_buf jump;
+};
+
+static void jpeg_error_exit(j_common_ptr cinfo) {
+    struct jpeg_error *err = (struct jpeg_error*)cinfo->err;
+    char msg[JMSG_LENGTH_MAX];
+    err->mgr.format_message(cinfo, msg);
+    fprintf(stderr, "JPEG error: %s\n", msg);
+    longjmp(err->jump, 1);
+}
+
+static bool load_jpeg(const char *path, struct decode_dest *dest) {
+    if (!path) {
+        return false;
+    }
+
+    ww_mapped_file_t file = {};
+    if (!ww_map_file(path, &file, "JPEG")) {
+        return false;
+    }
+
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error err;
+    cinfo.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = jpeg_error_exit;
+    if (setjmp(err.jump)) {
+        jpeg_destroy_decompress(&cinfo);
+        ww_unmap_file(&file);
+        return false;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, file.data, file.size);
+    jpeg_read_header(&cinfo, TRUE);
+
+    // Shrink by M/8 in the DCT domain as far as the caller allows: the
+    // IDCT then works on fewer coefficients and the full-size image is
+    // never produced. 8/8 when nothing smaller will do.
+    if (!dest->data && dest->min_width > 0 && dest->min_height > 0) {
+        unsigned int num = 1;
+        cinfo.scale_denom = 8;
+        for (; num < 8; num++) {
+            cinfo.scale_num = num;
+            jpeg_calc_output_dimensions(&cinfo);
+            if ((int)cinfo.output_width >= dest->min_width &&
+                (int)cinfo.output_height >= dest->min_height) {
+                break;
+            }
+        }
+        cinfo.scale_num = num;
+    }
 
-    if (!img->data) {
+    // libjpeg-turbo writes either byte order, alpha filled in
+    cinfo.out_color_space = dest->bgra ? JCS_EXT_BGRA : JCS_EXT_RGBA;
+    jpeg_start_decompress(&cinfo);
+
+    // Only the rows and columns the renders show. Columns are cut at iMCU
+    // boundaries, so the window may come back a little wider; rows above
+    // it are skipped without the IDCT, and decoding stops below it.
+    int full_width = (int)cinfo.output_width;
+    int full_height = (int)cinfo.output_height;
+    int x, y, width, height;
+    dest_window(dest, full_width, full_height, &x, &y, &width, &height);
+    if (width < full_width) {
+        // Chroma upsampling blends in the next pixel either side, which at
+        // the edge of a crop is the edge pixel again, so keep one spare
+        int left = x > 0 ? x - 1 : 0;
+        int right = x + width < full_width ? x + width + 1 : full_width;
+        JDIMENSION crop_x = (JDIMENSION)left;
+        JDIMENSION crop_width = (JDIMENSION)(right - left);
+        jpeg_crop_scanline(&cinfo, &crop_x, &crop_width);
+        x = (int)crop_x;
+        width = (int)crop_width;
+    }
+
+    if (!dest_begin_window(dest, full_width, full_height, x, y, width, height)) {
+        jpeg_destroy_decompress(&cinfo);
+        ww_unmap_file(&file);
+        return false;
+    }
+
+    if (y > 0) {
+        jpeg_skip_scanlines(&cinfo, (JDIMENSION)y);
+    }
+    for (int row_y = 0; row_y < height; row_y++) {
+        JSAMPROW row = dest_row(dest, row_y);
+        jpeg_read_scanlines(&cinfo, &row, 1);
+        dest_put_row(dest, row_y, row);
+    }
+    dest->swapped = dest->bgra;
+
+    // Finishing insists on every scanline having been read
+    if (cinfo.output_scanline == cinfo.output_height) {
+        jpeg_finish_decompress(&cinfo);
+    }
+    jpeg_destroy_decompress(&cinfo);
+    ww_unmap_file(&file);
+    return true;
+}
+
+static bool load_webp(const char *path, struct decode_dest *dest) 
+{
+    if (!path)
+        return false;
+
+    ww_mapped_file_t file = {};
+    if (!ww_map_file(path, &file, "WebP")) {
+        return false;
+    }
+
+    WebPDecoderConfig config;
+    if (!WebPInitDecoderConfig(&config) ||
+        WebPGetFeatures(file.data, file.size, &config.input) != VP8_STATUS_OK) {
         fprintf(stderr, "Failed to decode WebP\n");
-        free(img);
-        return nullptr;
+        ww_unmap_file(&file);
+        return false;
     }
 
-    return img;
+    int full_width = config.input.width;
+    int full_height = config.input.height;
+    int x = 0, y = 0, width = full_width, height = full_height;
+
+    if (!dest->data && dest->min_width > 0 && dest->min_height > 0 &&
+        (dest->min_width < full_width || dest->min_height < full_height)) {
+        // libwebp shrinks while decoding by averaging the pixels it folds
+        // together, much like our box filter, which spares both the
+        // full-size buffer and a resample. It never enlarges here: that
+        // would be bilinear.
+        width = full_width = dest->min_width < full_width ? dest->min_width : full_width;
+        height = full_height = dest->min_height < full_height ? dest->min_height : full_height;
+        config.options.use_scaling = 1;
+        config.options.scaled_width = width;
+        config.options.scaled_height = height;
+    } else {
+        // Or, at full size, leaves out what the renders crop off. libwebp
+        // crops from even coordinates, and its chroma upsampling at the
+        // edge of a crop differs from a full decode, so keep two spare
+        // pixels all round.
+        dest_window(dest, full_width, full_height, &x, &y, &width, &height);
+        if (width < full_width || height < full_height) {
+            int left = (x > 2 ? x - 2 : 0) & ~1;
+            int top = (y > 2 ? y - 2 : 0) & ~1;
+            int right = x + width + 2 < full_width ? x + width + 2 : full_width;
+            int bottom = y + height + 2 < full_height ? y + height + 2 : full_height;
+            x = left;
+            y = top;
+            width = right - left;
+            height = bottom - top;
+            config.options.use_cropping = 1;
+            config.options.crop_left = x;
+            config.options.crop_top = y;
+            config.options.crop_width = width;
+            config.options.crop_height = height;
+        }
+    }
+
+    if (!dest_begin_window(dest, full_width, full_height, x, y, width, height)) {
+        ww_unmap_file(&file);
+        return false;
+    }
+
+    // Straight into the destination, in whichever byte order it wants.
+    // libwebp filters on a thread of its own if we may use more than one.
+    config.options.use_threads = ww_parallel_threads() > 1;
+    config.output.colorspace = dest->bgra ? MODE_BGRA : MODE_RGBA;
+    config.output.is_external_memory = 1;
+    config.output.u.RGBA.rgba = dest->data;
+    config.output.u.RGBA.stride = (int)dest->stride;
+    config.output.u.RGBA.size = dest->stride * (size_t)height;
+
+    VP8StatusCode status = WebPDecode(file.data, file.size, &config);
+    WebPFreeDecBuffer(&config.output);
+    ww_unmap_file(&file);
+
+    if (status != VP8_STATUS_OK) {
+        fprintf(stderr, "Failed to decode WebP\n");
+        return false;
+    }
+
+    dest->swapped = dest->bgra;
+    return true;
+}
+
+// Read the width x height window at (x, y) of a TIFF through the RGBA
+// interface. Streaming goes a band of rows at a time, a band being a strip
+// or a row of tiles, so libtiff decodes each of them once; a file stored
+// as one big strip still ends up in memory whole. Strips or tiles wholly
+// outside the window are never read.
+static bool read_tiff_window(TIFF *tif, int x, int y, int width, int height,
+                             struct decode_dest *dest) {
+    char emsg[1024] = "";
+    TIFFRGBAImage img;
+    if (!TIFFRGBAImageOK(tif, emsg) || !TIFFRGBAImageBegin(&img, tif, 0, emsg)) {
+        fprintf(stderr, "Failed to read TIFF image: %s\n", emsg);
+        return false;
+    }
+    img.req_orientation = ORIENTATION_TOPLEFT;
+    img.col_offset = x;
+
+    uint32_t band = 0;
+    if (TIFFIsTiled(tif)) {
+        TIFFGetField(tif, TIFFTAG_TILELENGTH, &band);
+    } else {
+        TIFFGetFieldDefaulted(tif, TIFFTAG_ROWSPERSTRIP, &band);
+    }
+    // Nor a band at a time: other orientations are read in one piece
+    if (img.orientation != ORIENTATION_TOPLEFT) {
+        band = 0;
+    }
+
+    bool ok;
+    if (!dest->stream && dest->stride == (size_t)width * 4) {
+        // A packed destination takes the whole window in one go
+        img.row_offset = y;
+        ok = TIFFRGBAImageGet(&img, (uint32_t*)dest->data, (uint32_t)width, (uint32_t)height) != 0;
+    } else {
+        uint32_t rows_max = band == 0 || band > (uint32_t)height ? (uint32_t)height : band;
+        uint32_t *raster = (uint32_t*)malloc((size_t)width * 4 * rows_max);
+        ok = raster != nullptr;
+        for (int row = 0; ok && row < height; ) {
+            // Bands follow the file's strips, which the window need not
+            int rows = band ? (int)(band - (uint32_t)(y + row) % band) : height;
+            if (rows > height - row) {
+                rows = height - row;
+            }
+            img.row_offset = y + row;
+            ok = TIFFRGBAImageGet(&img, raster, (uint32_t)width, (uint32_t)rows) != 0;
+            for (int r = 0; ok && r < rows; r++) {
+                dest_put_row(dest, row + r, (const uint8_t*)(raster + (size_t)width * r));
+            }
+            row += rows;
+        }
+        free(raster);
+    }
+
+    TIFFRGBAImageEnd(&img);
+    if (!ok) {
+        fprintf(stderr, "Failed to read TIFF image\n");
+    }
+    return ok;
 }
 
-static image_data_t* load_tiff(const char *path) 
+static bool load_tiff(const char *path, struct decode_dest *dest) 
 {
     if (!path)
-        return nullptr;
+        return false;
 
     TIFF *tif = TIFFOpen(path, "r");
     if (!tif) {
         fprintf(stderr, "Failed to open TIFF file: %s\n", path);
-        return nullptr;
-    }
-
-    image_data_t *img = (image_data_t*)malloc(sizeof(image_data_t));
-    if (!img) {
-        TIFFClose(tif);
-        return nullptr;
+        return false;
     }
 
-    // img comes from malloc, so width/height are indeterminate until set, and
-    // TIFFGetField can fail on a malformed file. Ignoring its return value meant
-    // allocating from whatever happened to be on the heap.
+    // TIFFGetField can fail on a malformed file. Ignoring its return value
+    // meant allocating from whatever happened to be on the stack.
     uint32_t tw = 0, th = 0;
     if (!TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &tw) ||
         !TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &th) ||
-        tw == 0 || th == 0) {
+        tw == 0 || th == 0 || tw > INT32_MAX || th > INT32_MAX) {
         fprintf(stderr, "TIFF has no usable dimensions: %s\n", path);
         TIFFClose(tif);
-        free(img);
-        return nullptr;
+        return false;
     }
-    img->width = (int)tw;
-    img->height = (int)th;
-    img->channels = 4;
 
-    // size_t throughout: w * h * 4 in int overflows around 23000x23000, and the
-    // dimensions come from the file, so they are not ours to trust.
-    size_t npixels = (size_t)tw * (size_t)th;
-    if (npixels > (size_t)1 << 28) { // ~268M pixels, over 1GiB decoded
-        fprintf(stderr, "TIFF too large (%ux%u): %s\n", tw, th, path);
-        TIFFClose(tif);
-        free(img);
-        return nullptr;
+    // The RGBA interface flips other orientations within each read, so
+    // only top-left files can be read a window at a time
+    uint16_t orientation = ORIENTATION_TOPLEFT;
+    TIFFGetFieldDefaulted(tif, TIFFTAG_ORIENTATION, &orientation);
+    int x = 0, y = 0, width = (int)tw, height = (int)th;
+    if (orientation == ORIENTATION_TOPLEFT) {
+        dest_window(dest, width, height, &x, &y, &width, &height);
     }
-    img->data = (uint8_t*)malloc(npixels * 4);
-    if (!img->data) {
+    if (!dest_begin_window(dest, (int)tw, (int)th, x, y, width, height)) {
         TIFFClose(tif);
-        free(img);
-        return nullptr;
+        return false;
     }
 
-    if (!TIFFReadRGBAImageOriented(tif, img->width, img->height,
-                                   (uint32_t*)img->data, ORIENTATION_TOPLEFT, 0)) {
-        fprintf(stderr, "Failed to read TIFF image\n");
-        free(img->data);
-        free(img);
+    if (dest->stream || width != (int)tw || height != (int)th) {
+        bool ok = read_tiff_window(tif, x, y, width, height, dest);
         TIFFClose(tif);
-        return nullptr;
+        return ok;
+    }
+
+    // The RGBA interface wants packed rows; a strided destination gets a
+    // packed copy first
+    size_t row_bytes = (size_t)tw * 4;
+    uint32_t *raster = (uint32_t*)dest->data;
+    if (dest->stride != row_bytes) {
+        raster = (uint32_t*)malloc(row_bytes * th);
+        if (!raster) {
+            TIFFClose(tif);
+            return false;
+        }
     }
 
+    // Each uint32 is ABGR, which on a little-endian machine is R, G, B, A
+    // in memory: already our RGBA order
+    int ok = TIFFReadRGBAImageOriented(tif, tw, th, raster, ORIENTATION_TOPLEFT, 0);
     TIFFClose(tif);
 
-    for (size_t i = 0; i < npixels; i++) {
-        uint8_t r = img->data[i * 4 + 0];
-        uint8_t g = img->data[i * 4 + 1];
-        uint8_t b = img->data[i * 4 + 2];
-        uint8_t a = img->data[i * 4 + 3];
-        
-        img->data[i * 4 + 0] = b;
-        img->data[i * 4 + 1] = g;
-        img->data[i * 4 + 2] = r;
-        img->data[i * 4 + 3] = a;
+    if (raster != (uint32_t*)dest->data) {
+        if (ok) {
+            for (uint32_t y = 0; y < th; y++) {
+                memcpy(dest->data + dest->stride * y, (uint8_t*)raster + row_bytes * y, row_bytes);
+            }
+        }
+        free(raster);
     }
 
-    return img;
+    if (!ok) {
+        fprintf(stderr, "Failed to read TIFF image\n");
+        return false;
+    }
+
+    return true;
 }
 
-static image_data_t* load_jxl(const char *path) {
-    if (!path) {
-        return nullptr;
-    }
+// libjxl's parallel runner interface on top of our worker pool, so JXL
+// decoding shares the threads (and the -j limit) used for scaling
+struct jxl_run {
+    void *opaque;
+    JxlParallelRunFunction func;
+    uint32_t start;
+};
 
-    FILE *file = fopen(path, "rb");
-    if (!file) {
-        fprintf(stderr, "Failed to open JXL file: %s\n", path);
-        return nullptr;
+static void jxl_run_one(void *ctx, int index, int thread_id) {
+    struct jxl_run *run = (struct jxl_run*)ctx;
+    run->func(run->opaque, run->start + (uint32_t)index, (size_t)thread_id);
+}
+
+static JxlParallelRetCode jxl_runner(void *runner_opaque, void *jpegxl_opaque,
+                                     JxlParallelRunInit init, JxlParallelRunFunction func,
+                                     uint32_t start_range, uint32_t end_range) {
+    (void)runner_opaque;
+    
+    // libjxl keeps scratch space per thread id, and ours run from 0 to the
+    // pool size. Non-worker threads all count as 0, which is fine while
+    // images are only ever decoded from one thread at a time.
+    if (init(jpegxl_opaque, (size_t)ww_parallel_threads()) != JXL_PARALLEL_RET_SUCCESS) {
+        return JXL_PARALLEL_RET_RUNNER_ERROR;
+    }
+    
+    if (end_range > start_range) {
+        struct jxl_run run = { jpegxl_opaque, func, start_range };
+        ww_parallel_for((int)(end_range - start_range), jxl_run_one, &run);
     }
+    return JXL_PARALLEL_RET_SUCCESS;
+}
 
-    fseek(file, 0, SEEK_END);
-    long file_len = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    // ftell returns -1 on error -- a directory, say. Assigning that to a size_t
-    // made file_size SIZE_MAX, so the malloc below merely "failed" and the user
-    // saw an out-of-memory rather than "not a readable file".
-    if (file_len <= 0) {
-        fprintf(stderr, "Not a readable file: %s\n", path);
-        fclose(file);
-        return nullptr;
+// libjxl only writes RGBA, and only whole images. For a BGRA destination
+// or a window of the image it hands over runs of pixels instead, possibly
+// from several threads, which are clipped and swapped on their way into
+// place. It still decodes everything; only the copy is saved.
+static void jxl_write_pixels(void *opaque, size_t x, size_t y, size_t num_pixels, const void *pixels) {
+    struct decode_dest *dest = (struct decode_dest*)opaque;
+    size_t left = (size_t)dest->x;
+    size_t right = left + (size_t)dest->width;
+    if (y < (size_t)dest->y || y >= (size_t)(dest->y + dest->height) ||
+        x >= right || x + num_pixels <= left) {
+        return;
     }
-    size_t file_size = (size_t)file_len;
+    
+    size_t first = x > left ? x : left;
+    size_t end = x + num_pixels < right ? x + num_pixels : right;
+    const uint8_t *in = (const uint8_t*)pixels + (first - x) * 4;
+    uint8_t *out = dest->data + dest->stride * (y - dest->y) + (first - left) * 4;
+    if (dest->bgra) {
+        ww_swizzle_rgba(out, in, end - first);
+    } else {
+        memcpy(out, in, (end - first) * 4);
+    }
+}
 
-    uint8_t *file_data = (uint8_t*)malloc(file_size);
-    if (!file_data) {
-        fclose(file);
-        return nullptr;
+static bool load_jxl(const char *path, struct decode_dest *dest) {
+    if (!path) {
+        return false;
     }
 
-    if (fread(file_data, 1, file_size, file) != file_size) {
-        fprintf(stderr, "Failed to read JXL file\n");
-        free(file_data);
-        fclose(file);
-        return nullptr;
+    ww_mapped_file_t file = {};
+    if (!ww_map_file(path, &file, "JXL")) {
+        return false;
     }
-    fclose(file);
 
     auto dec = JxlDecoderMake(nullptr);
     if (!dec) {
         fprintf(stderr, "Failed to create JXL decoder\n");
-        free(file_data);
-        return nullptr;
+        ww_unmap_file(&file);
+        return false;
     }
 
-    if (JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_BASIC_INFO | JXL_DEC_FULL_IMAGE) != JXL_DEC_SUCCESS) {
-        fprintf(stderr, "Failed to subscribe to JXL events\n");
-        free(file_data);
-        return nullptr;
+    if (JxlDecoderSetParallelRunner(dec.get(), jxl_runner, nullptr) != JXL_DEC_SUCCESS) {
+        fprintf(stderr, "Failed to set JXL parallel runner\n");
+        ww_unmap_file(&file);
+        return false;
     }
 
-    JxlDecoderSetInput(dec.get(), file_data, file_size);
-    JxlDecoderCloseInput(dec.get());
+    // For a preview, only the DC pass: an 8x-reduced image, upsampled
+    int events = JXL_DEC_BASIC_INFO | JXL_DEC_FULL_IMAGE;
+    if (dest->preview) {
+        events |= JXL_DEC_FRAME_PROGRESSION;
+        JxlDecoderSetProgressiveDetail(dec.get(), kDC);
+    }
 
-    image_data_t *img = (image_data_t*)malloc(sizeof(image_data_t));
-    if (!img) {
-        free(file_data);
-        return nullptr;
+    if (JxlDecoderSubscribeEvents(dec.get(), events) != JXL_DEC_SUCCESS) {
+        fprintf(stderr, "Failed to subscribe to JXL events\n");
+        ww_unmap_file(&file);
+        return false;
     }
-    img->data = nullptr;
-    img->channels = 4;
+
+    JxlDecoderSetInput(dec.get(), file.data, file.size);
+    JxlDecoderCloseInput(dec.get());
 
     JxlBasicInfo info;
     JxlPixelFormat format = {4, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+    bool have_output = false;
 
     for (;;) {
         JxlDecoderStatus status = JxlDecoderProcessInput(dec.get());
 
         if (status == JXL_DEC_ERROR) {
             fprintf(stderr, "JXL decoder error\n");
-            free(file_data);
-            free(img);
-            return nullptr;
+            ww_unmap_file(&file);
+            return false;
         } else if (status == JXL_DEC_NEED_MORE_INPUT) {
             fprintf(stderr, "JXL decoder needs more input\n");
-            free(file_data);
-            free(img);
-            return nullptr;
+            ww_unmap_file(&file);
+            return false;
         } else if (status == JXL_DEC_BASIC_INFO) {
             if (JxlDecoderGetBasicInfo(dec.get(), &info) != JXL_DEC_SUCCESS) {
                 fprintf(stderr, "Failed to get JXL basic info\n");
-                free(file_data);
-                free(img);
-                return nullptr;
+                ww_unmap_file(&file);
+                return false;
+            }
+            int x, y, width, height;
+            dest_window(dest, (int)info.xsize, (int)info.ysize, &x, &y, &width, &height);
+            if (!dest_begin_window(dest, (int)info.xsize, (int)info.ysize, x, y, width, height)) {
+                ww_unmap_file(&file);
+                return false;
             }
-            img->width = info.xsize;
-            img->height = info.ysize;
+            // Rows are rounded up to a multiple of align, so aligning to
+            // the stride itself gives exactly that stride
+            format.align = dest->stride;
+        } else if (status == JXL_DEC_NEED_IMAGE_OUT_BUFFER &&
+                   (dest->bgra || dest->width != dest->full_width || dest->height != dest->full_height)) {
+            if (JxlDecoderSetImageOutCallback(dec.get(), &format, jxl_write_pixels, dest) != JXL_DEC_SUCCESS) {
+                fprintf(stderr, "Failed to set JXL output callback\n");
+                ww_unmap_file(&file);
+                return false;
+            }
+            dest->swapped = dest->bgra;
+            have_output = true;
         } else if (status == JXL_DEC_NEED_IMAGE_OUT_BUFFER) {
             size_t buffer_size;
-            if (JxlDecoderImageOutBufferSize(dec.get(), &format, &buffer_size) != JXL_DEC_SUCCESS) {
+            if (JxlDecoderImageOutBufferSize(dec.get(), &format, &buffer_size) != JXL_DEC_SUCCESS ||
+                buffer_size > dest->stride * (size_t)dest->height) {
                 fprintf(stderr, "Failed to get JXL output buffer size\n");
-                free(file_data);
-                free(img);
-                return nullptr;
-            }
-
-            img->data = (uint8_t*)malloc(buffer_size);
-            if (!img->data) {
-                free(file_data);
-                free(img);
-                return nullptr;
+                ww_unmap_file(&file);
+                return false;
             }
 
-            if (JxlDecoderSetImageOutBuffer(dec.get(), &format, img->data, buffer_size) != JXL_DEC_SUCCESS) {
+            if (JxlDecoderSetImageOutBuffer(dec.get(), &format, dest->data, buffer_size) != JXL_DEC_SUCCESS) {
                 fprintf(stderr, "Failed to set JXL output buffer\n");
-                free(img->data);
-                free(file_data);
-                free(img);
-                return nullptr;
+                ww_unmap_file(&file);
+                return false;
+            }
+            have_output = true;
+        } else if (status == JXL_DEC_FRAME_PROGRESSION) {
+            if (JxlDecoderFlushImage(dec.get()) == JXL_DEC_SUCCESS) {
+                break;
             }
         } else if (status == JXL_DEC_FULL_IMAGE) {
+            // No DC pass came first (lossless modular files have none), so
+            // this is the final image, not a preview of it
+            dest->preview = false;
             break;
         } else if (status == JXL_DEC_SUCCESS) {
             break;
         }
     }
 
-    free(file_data);
+    ww_unmap_file(&file);
 
-    if (!img->data) {
+    if (!have_output) {
         fprintf(stderr, "Failed to decode JXL image\n");
-        free(img);
-        return nullptr;
+        return false;
     }
 
-    return img;
+    return true;
 }
 
-static image_data_t* load_farbfeld(const char *path) {
+static bool load_farbfeld(const char *path, struct decode_dest *dest) {
     if (!path) {
-        return nullptr;
+        return false;
     }
 
-    FILE *file = fopen(path, "rb");
-    if (!file) {
-        fprintf(stderr, "Failed to open Farbfeld file: %s\n", path);
-        return nullptr;
+    ww_mapped_file_t file = {};
+    if (!ww_map_file(path, &file, "Farbfeld")) {
+        return false;
     }
 
-    uint8_t magic[8];
-    if (fread(magic, 1, 8, file) != 8 || memcmp(magic, "farbfeld", 8) != 0) {
+    if (file.size < 16 || memcmp(file.data, "farbfeld", 8) != 0) {
         fprintf(stderr, "Invalid Farbfeld magic\n");
-        fclose(file);
-        return nullptr;
+        ww_unmap_file(&file);
+        return false;
     }
 
     uint32_t width_be, height_be;
-    if (fread(&width_be, 4, 1, file) != 1 || fread(&height_be, 4, 1, file) != 1) {
-        fprintf(stderr, "Failed to read Farbfeld dimensions\n");
-        fclose(file);
-        return nullptr;
-    }
-
+    memcpy(&width_be, file.data + 8, 4);
+    memcpy(&height_be, file.data + 12, 4);
     uint32_t width = __builtin_bswap32(width_be);
     uint32_t height = __builtin_bswap32(height_be);
-
-    image_data_t *img = (image_data_t*)malloc(sizeof(image_data_t));
-    if (!img) {
-        fclose(file);
-        return nullptr;
+    if (width == 0 || height == 0 || width > INT32_MAX || height > INT32_MAX) {
+        ww_unmap_file(&file);
+        return false;
     }
 
-    img->width = width;
-    img->height = height;
-    img->channels = 4;
-    img->data = (uint8_t*)malloc(width * height * 4);
+    // Check the pixels are all there before anything is allocated; the
+    // dimensions are under 2^31, so the product fits
+    size_t row_bytes = (size_t)width * 8;
+    if ((file.size - 16) / row_bytes < height) {
+        fprintf(stderr, "Failed to read Farbfeld pixel data\n");
+        ww_unmap_file(&file);
+        return false;
+    }
 
-    if (!img->data) {
-        free(img);
-        fclose(file);
-        return nullptr;
+    // Any window of the mapping is as easy to read as the whole
+    int x, y, window_width, window_height;
+    dest_window(dest, (int)width, (int)height, &x, &y, &window_width, &window_height);
+    if (!dest_begin_window(dest, (int)width, (int)height, x, y, window_width, window_height)) {
+        ww_unmap_file(&file);
+        return false;
     }
 
-    for (uint32_t i = 0; i < width * height; i++) {
-        uint16_t rgba[4];
-        if (fread(rgba, 2, 4, file) != 4) {
-            fprintf(stderr, "Failed to read Farbfeld pixel data\n");
-            free(img->data);
-            free(img);
-            fclose(file);
-            return nullptr;
+    // 16-bit big-endian RGBA straight from the mapping, keeping the high
+    // bytes; one call when the destination rows are packed
+    const uint8_t *pixels = file.data + 16 + row_bytes * y + (size_t)x * 8;
+    if (!dest->stream && window_width == (int)width && dest->stride == (size_t)width * 4) {
+        ww_narrow_rgba16be(dest->data, pixels, (size_t)width * window_height);
+    } else {
+        for (int row_y = 0; row_y < window_height; row_y++) {
+            uint8_t *row = dest_row(dest, row_y);
+            ww_narrow_rgba16be(row, pixels + row_bytes * row_y, window_width);
+            dest_put_row(dest, row_y, row);
         }
-
-        img->data[i * 4 + 0] = __builtin_bswap16(rgba[0]) >> 8;
-        img->data[i * 4 + 1] = __builtin_bswap16(rgba[1]) >> 8;
-        img->data[i * 4 + 2] = __builtin_bswap16(rgba[2]) >> 8;
-        img->data[i * 4 + 3] = __builtin_bswap16(rgba[3]) >> 8;
     }
 
-    fclose(file);
-    return img;
+    ww_unmap_file(&file);
+    return true;
 }
 
-static image_data_t* load_image(const char *path) {
+static bool load_image(const char *path, struct decode_dest *dest) {
     if (!path) {
-        return nullptr;
+        return false;
     }
 
-    image_data_t *img = (image_data_t*)malloc(sizeof(image_data_t));
-    if (!img) {
-        return nullptr;
+    ww_mapped_file_t file = {};
+    if (!ww_map_file(path, &file, "image")) {
+        return false;
+    }
+    if (file.size > INT_MAX) {
+        fprintf(stderr, "Image file too large: %s\n", path);
+        ww_unmap_file(&file);
+        return false;
     }
 
     // Force load as RGBA (4 channels)
-    img->data = stbi_load(path, &img->width, &img->height, &img->channels, 4);
+    int width, height, channels;
+    uint8_t *pixels = stbi_load_from_memory(file.data, (int)file.size, &width, &height, &channels, 4);
+    ww_unmap_file(&file);
     
-    if (!img->data) {
+    if (!pixels) {
         fprintf(stderr, "stb_image error: %s\n", stbi_failure_reason());
-        free(img);
-        return nullptr;
+        return false;
     }
 
-    return img;
-}
-
+    // stb allocates its own buffer; with nowhere else to put the pixels
+    // that buffer becomes the image, whole
+    if (!dest->data && !dest->stream) {
+        image_data_t *img = (image_data_t*)malloc(sizeof(image_data_t));
+        if (!img) {
+            stbi_image_free(pixels);
+            return false;
+        }
+        init_image(img, pixels, width, height);
+        dest->img = img;
+        dest->data = pixels;
+        dest->stride = (size_t)width * 4;
+        dest->width = width;
+        dest->height = height;
+        dest->x = 0;
+        dest->y = 0;
+        dest->full_width = width;
+        dest->full_height = height;
+        return true;
+    }
 
+    if (!dest_begin(dest, width, height)) {
+        stbi_image_free(pixels);
+        return false;
+    }
 
-static inline float cubic_hermite(float A, float B, float C, float D, float t) {
-    float a = -A / 2.0f + (3.0f * B) / 2.0f - (3.0f * C) / 2.0f + D / 2.0f;
-    float b = A - (5.0f * B) / 2.0f + 2.0f * C - D / 2.0f;
-    float c = -A / 2.0f + C / 2.0f;
-    float d = B;
-    return a * t * t * t + b * t * t + c * t + d;
-}
+    size_t row_bytes = (size_t)width * 4;
+    for (int y = 0; y < height; y++) {
+        const uint8_t *in = pixels + row_bytes * y;
+        if (dest->bgra) {
+            uint8_t *out = dest_row(dest, y);
+            ww_swizzle_rgba(out, in, width);
+            in = out;
+        }
+        dest_put_row(dest, y, in);
+    }
+    dest->swapped = dest->bgra;
 
-static inline uint8_t clamp_u8(float value) {
-    if (value < 0.0f) return 0;
-    if (value > 255.0f) return 255;
-    return (uint8_t)value;
+    stbi_image_free(pixels);
+    return true;
 }
 
-static void scale_bilinear(const image_data_t *src, image_data_t *dst) {
-    float x_ratio = (float)src->width / (float)dst->width;
-    float y_ratio = (float)src->height / (float)dst->height;
+// Decode into dest with whichever loader suits the file, in the byte
+// order dest asks for
+static bool decode_file(const char *path, struct decode_dest *dest) {
+    const char *ext = strrchr(path, '.');
+    bool ok = false;
     
-    for (int y = 0; y < dst->height; y++) {
-        for (int x = 0; x < dst->width; x++) {
-            float src_x = x * x_ratio;
-            float src_y = y * y_ratio;
-            
-            int x1 = (int)src_x;
-            int y1 = (int)src_y;
-            int x2 = (x1 + 1 < src->width) ? x1 + 1 : x1;
-            int y2 = (y1 + 1 < src->height) ? y1 + 1 : y1;
-            
-            float x_diff = src_x - x1;
-            float y_diff = src_y - y1;
-            
-            int dst_idx = (y * dst->width + x) * 4;
-            
-            for (int c = 0; c < 4; c++) {
-                int idx_tl = (y1 * src->width + x1) * 4 + c;
-                int idx_tr = (y1 * src->width + x2) * 4 + c;
-                int idx_bl = (y2 * src->width + x1) * 4 + c;
-                int idx_br = (y2 * src->width + x2) * 4 + c;
-                
-                float top = src->data[idx_tl] * (1.0f - x_diff) + src->data[idx_tr] * x_diff;
-                float bottom = src->data[idx_bl] * (1.0f - x_diff) + src->data[idx_br] * x_diff;
-                float value = top * (1.0f - y_diff) + bottom * y_diff;
-                dst->data[dst_idx + c] = clamp_u8(value);
-            }
+    if (ext) {
+        ext++;
+        if (strcasecmp(ext, "jpg") == 0 || strcasecmp(ext, "jpeg") == 0) {
+            ok = load_jpeg(path, dest);
+        } else if (strcasecmp(ext, "webp") == 0) {
+            ok = load_webp(path, dest);
+        } else if (strcasecmp(ext, "tiff") == 0 || strcasecmp(ext, "tif") == 0) {
+            ok = load_tiff(path, dest);
+        } else if (strcasecmp(ext, "jxl") == 0) {
+            ok = load_jxl(path, dest);
+        } else if (strcasecmp(ext, "ff") == 0) {
+            ok = load_farbfeld(path, dest);
         }
     }
-}
-
-static void scale_bicubic(const image_data_t *src, image_data_t *dst) {
-    float x_ratio = (float)src->width / (float)dst->width;
-    float y_ratio = (float)src->height / (float)dst->height;
     
-    for (int y = 0; y < dst->height; y++) {
-        for (int x = 0; x < dst->width; x++) {
-            float src_x = x * x_ratio;
-            float src_y = y * y_ratio;
-            
-            int x1 = (int)src_x;
-            int y1 = (int)src_y;
-            
-            float x_diff = src_x - x1;
-            float y_diff = src_y - y1;
-            
-            int dst_idx = (y * dst->width + x) * 4;
-            
-            for (int c = 0; c < 4; c++) {
-                float col[4];
-                
-                for (int ky = 0; ky < 4; ky++) {
-                    int sy = y1 - 1 + ky;
-                    sy = (sy < 0) ? 0 : ((sy >= src->height) ? src->height - 1 : sy);
-                    
-                    float row[4];
-                    for (int kx = 0; kx < 4; kx++) {
-                        int sx = x1 - 1 + kx;
-                        sx = (sx < 0) ? 0 : ((sx >= src->width) ? src->width - 1 : sx);
-                        
-                        int idx = (sy * src->width + sx) * 4 + c;
-                        row[kx] = src->data[idx];
-                    }
-                    
-                    col[ky] = cubic_hermite(row[0], row[1], row[2], row[3], x_diff);
-                }
-                
-                float value = cubic_hermite(col[0], col[1], col[2], col[3], y_diff);
-                dst->data[dst_idx + c] = clamp_u8(value);
-            }
+    // Fall back to stb_image for other formats
+    if (!ok) {
+        dest_reset(dest);
+        ok = load_image(path, dest);
+    }
+    if (!ok) {
+        dest_reset(dest);
+        return false;
+    }
+    
+    if (dest->bgra && !dest->swapped) {
+        for (int y = 0; y < dest->height; y++) {
+            uint8_t *row = dest->data + dest->stride * y;
+            ww_swizzle_rgba(row, row, dest->width);
         }
     }
+    return true;
 }
 
-static image_data_t* scale_image(const image_data_t *src, int target_width, int target_height, bool preserve_aspect) {
-    if (!src || !src->data) {
-        return nullptr;
+// Bicubic for enlarging and light shrinking. Heavier shrinking needs a
+// filter that widens with the factor or it aliases: Lanczos-3 up to 4x,
+// then a box (area average), whose cost stays proportional to the source
+// size. Bilinear is plenty for enlarging more than 4x.
+static ww_filter_t choose_filter(int src_width, int scaled_width) {
+    float scale_factor = (float)src_width / scaled_width;
+    if (scale_factor > 4.0f) {
+        return WW_FILTER_BOX;
+    } else if (scale_factor > 2.0f) {
+        return WW_FILTER_LANCZOS3;
+    } else if (scale_factor < 0.25f) {
+        return WW_FILTER_BILINEAR;
     }
+    return WW_FILTER_BICUBIC;
+}
 
-    int new_width = target_width;
-    int new_height = target_height;
-
-    if (preserve_aspect) {
-        float src_aspect = (float)src->width / (float)src->height;
-        float dst_aspect = (float)target_width / (float)target_height;
+// Where the image goes on an output-sized canvas in the modes that scale
+// it: scaled to scaled_width x scaled_height, the draw_width x draw_height
+// window at (crop_x, crop_y) of that lands at (x, y), and everything else
+// is background
+struct render_layout {
+    int scaled_width;
+    int scaled_height;
+    int crop_x;
+    int crop_y;
+    int x;
+    int y;
+    int draw_width;
+    int draw_height;
+};
 
-        if (src_aspect > dst_aspect) {
-            new_width = target_width;
-            new_height = (int)(target_width / src_aspect);
+static void layout_render(int image_width, int image_height, int output_width, int output_height,
+                          int mode, struct render_layout *layout) {
+    double img_aspect = (double)image_width / image_height;
+    double out_aspect = (double)output_width / output_height;
+    
+    *layout = {};
+    layout->scaled_width = output_width;
+    layout->scaled_height = output_height;
+    layout->draw_width = output_width;
+    layout->draw_height = output_height;
+    
+    if (mode == WW_MODE_FIT) {
+        // Letterboxed: the whole image, centred
+        // Rounded to nearest, so that laying out an image already decoded
+        // at the scaled size gives that size back
+        if (img_aspect > out_aspect) {
+            layout->scaled_height = (int)lround(output_width / img_aspect);
         } else {
-            new_height = target_height;
-            new_width = (int)(target_height * src_aspect);
+            layout->scaled_width = (int)lround(output_height * img_aspect);
         }
+        if (layout->scaled_width < 1) layout->scaled_width = 1;
+        if (layout->scaled_height < 1) layout->scaled_height = 1;
+        
+        layout->x = (output_width - layout->scaled_width) / 2;
+        layout->y = (output_height - layout->scaled_height) / 2;
+        layout->draw_width = layout->scaled_width;
+        layout->draw_height = layout->scaled_height;
+    } else if (mode == WW_MODE_FILL) {
+        // Covering the output, the middle of it kept
+        if (img_aspect > out_aspect) {
+            layout->scaled_width = (int)lround(output_height * img_aspect);
+        } else {
+            layout->scaled_height = (int)lround(output_width / img_aspect);
+        }
+        
+        // Rounding can leave the long side a pixel short of the output
+        if (layout->scaled_width < output_width) layout->scaled_width = output_width;
+        if (layout->scaled_height < output_height) layout->scaled_height = output_height;
+        
+        layout->crop_x = (layout->scaled_width - output_width) / 2;
+        layout->crop_y = (layout->scaled_height - output_height) / 2;
     }
+}
 
-    image_data_t *scaled = (image_data_t*)malloc(sizeof(image_data_t));
-    if (!scaled) {
-        return nullptr;
-    }
+// Where a decoded image sits in the whole image, for decoders that gave
+// just a window of it
+struct source_window {
+    int x;
+    int y;
+    int full_width;
+    int full_height;
+};
 
-    scaled->width = new_width;
-    scaled->height = new_height;
-    scaled->channels = 4; // RGBA
-    scaled->data = (uint8_t*)malloc(new_width * new_height * 4);
+// The part of a full_width x full_height image that a render shows: for
+// fill, what the scaler reads of the middle it keeps; for centre and tile,
+// the pixels that land on the output. Fit and stretch show all of it.
+static void render_window(int full_width, int full_height, int output_width, int output_height,
+                          int mode, int *x, int *y, int *width, int *height) {
+    *x = 0;
+    *y = 0;
+    *width = full_width;
+    *height = full_height;
     
-    if (!scaled->data) {
-        free(scaled);
-        return nullptr;
+    if (mode == WW_MODE_FILL) {
+        struct render_layout layout;
+        layout_render(full_width, full_height, output_width, output_height, mode, &layout);
+        int rx, ry, rw, rh;
+        if (ww_scale_source_rect(full_width, full_height, layout.scaled_width, layout.scaled_height,
+                                 layout.crop_x, layout.crop_y, layout.draw_width, layout.draw_height,
+                                 choose_filter(full_width, layout.scaled_width),
+                                 &rx, &ry, &rw, &rh) == 0) {
+            *x = rx;
+            *y = ry;
+            *width = rw;
+            *height = rh;
+        }
+    } else if (mode == WW_MODE_CENTER) {
+        if (full_width > output_width) {
+            *x = (full_width - output_width) / 2;
+            *width = output_width;
+        }
+        if (full_height > output_height) {
+            *y = (full_height - output_height) / 2;
+            *height = output_height;
+        }
+    } else if (mode == WW_MODE_TILE) {
+        if (full_width > output_width) *width = output_width;
+        if (full_height > output_height) *height = output_height;
     }
+}
 
-    // Use bicubic scaling for best quality
-    // Falls back to bilinear for very large scale factors (>4x)
-    float scale_factor = (float)src->width / new_width;
-    if (scale_factor > 4.0f || scale_factor < 0.25f) {
-        // Use faster bilinear for extreme scaling
-        scale_bilinear(src, scaled);
-    } else {
-        // Use bicubic for normal scaling (best quality)
-        scale_bicubic(src, scaled);
+// Fill everything of a canvas outside the rectangle at (x, y) with the
+// background colour, leaving the rectangle for an image
+static void fill_around(image_data_t *canvas, int x, int y, int width, int height, uint32_t bg_color) {
+    size_t stride = canvas->stride;
+    
+    ww_fill_rgba(canvas->data, (size_t)y * canvas->width, bg_color);
+    for (int row = y; row < y + height; row++) {
+        uint8_t *line = canvas->data + stride * row;
+        ww_fill_rgba(line, x, bg_color);
+        ww_fill_rgba(line + (size_t)(x + width) * 4, canvas->width - x - width, bg_color);
     }
-
-    return scaled;
+    ww_fill_rgba(canvas->data + stride * (y + height),
+                 (size_t)(canvas->height - y - height) * canvas->width, bg_color);
 }
 
-// Create a centered/letterboxed image with configurable background
-static image_data_t* center_image(const image_data_t *src, int canvas_width, int canvas_height, uint32_t bg_color) {
+// Create a centered/letterboxed image with configurable background. src
+// may be just the window of the image that shows.
+static image_data_t* center_image(image_data_t *src, const struct source_window *window,
+                                  int canvas_width, int canvas_height, uint32_t bg_color) {
     if (!src || !src->data) {
         return nullptr;
     }
 
-    image_data_t *canvas = (image_data_t*)malloc(sizeof(image_data_t));
+    // Calculate centering offset; an image larger than the canvas has its
+    // middle cut out instead
+    int offset_x = (canvas_width - window->full_width) / 2;
+    int offset_y = (canvas_height - window->full_height) / 2;
+    
+    int dst_x = offset_x > 0 ? offset_x : 0;
+    int dst_y = offset_y > 0 ? offset_y : 0;
+    int copy_width = window->full_width < canvas_width ? window->full_width : canvas_width;
+    int copy_height = window->full_height < canvas_height ? window->full_height : canvas_height;
+    
+    // Where that part starts within the pixels we have
+    int src_x = (offset_x < 0 ? -offset_x : 0) - window->x;
+    int src_y = (offset_y < 0 ? -offset_y : 0) - window->y;
+    if (src_x < 0 || src_y < 0 || src_x + copy_width > src->width || src_y + copy_height > src->height) {
+        return nullptr;
+    }
+
+    // No background showing: the result is just the middle of the source
+    if (copy_width == canvas_width && copy_height == canvas_height) {
+        return ww_view_image(src, src_x, src_y, canvas_width, canvas_height);
+    }
+
+    image_data_t *canvas = ww_alloc_image(canvas_width, canvas_height);
     if (!canvas) {
         return nullptr;
     }
 
-    canvas->width = canvas_width;
-    canvas->height = canvas_height;
-    canvas->channels = 4;
-    canvas->data = (uint8_t*)malloc(canvas_width * canvas_height * 4);
-    
-    if (!canvas->data) {
-        free(canvas);
+    fill_around(canvas, dst_x, dst_y, copy_width, copy_height, bg_color);
+
+    // Copy the visible part a row at a time
+    for (int y = 0; y < copy_height; y++) {
+        memcpy(canvas->data + canvas->stride * (dst_y + y) + (size_t)dst_x * 4,
+               src->data + src->stride * (src_y + y) + (size_t)src_x * 4,
+               (size_t)copy_width * 4);
+    }
+
+    return canvas;
+}
+
+// Repeat an image from the top-left corner across a canvas. Only one
+// period of rows is built from the source; everything else is copied
+// from what is already there, doubling the copied span each time, so the
+// work is a handful of large memcpys.
+static image_data_t* tile_image(const image_data_t *src, int canvas_width, int canvas_height) {
+    image_data_t *canvas = ww_alloc_image(canvas_width, canvas_height);
+    if (!canvas) {
         return nullptr;
     }
     
-    // Fill with background color (RGBA format)
-    uint8_t bg_r = (bg_color >> 24) & 0xFF;
-    uint8_t bg_g = (bg_color >> 16) & 0xFF;
-    uint8_t bg_b = (bg_color >> 8) & 0xFF;
-    uint8_t bg_a = bg_color & 0xFF;
+    size_t src_stride = src->stride;
+    size_t row_bytes = (size_t)canvas_width * 4;
+    size_t period_bytes = (size_t)(src->width < canvas_width ? src->width : canvas_width) * 4;
+    int period_rows = src->height < canvas_height ? src->height : canvas_height;
     
-    for (int i = 0; i < canvas_width * canvas_height; i++) {
-        canvas->data[i * 4 + 0] = bg_r;
-        canvas->data[i * 4 + 1] = bg_g;
-        canvas->data[i * 4 + 2] = bg_b;
-        canvas->data[i * 4 + 3] = bg_a;
+    for (int y = 0; y < period_rows; y++) {
+        uint8_t *row = canvas->data + row_bytes * y;
+        memcpy(row, src->data + src_stride * y, period_bytes);
+        
+        // The filled part is always a whole number of periods, so copying
+        // it forward keeps the pattern in phase
+        for (size_t filled = period_bytes; filled < row_bytes; filled *= 2) {
+            memcpy(row + filled, row, filled < row_bytes - filled ? filled : row_bytes - filled);
+        }
     }
+    
+    // Same doubling over whole rows, which are contiguous in the canvas
+    size_t total = row_bytes * canvas_height;
+    for (size_t filled = row_bytes * period_rows; filled < total; filled *= 2) {
+        memcpy(canvas->data + filled, canvas->data, filled < total - filled ? filled : total - filled);
+    }
+    
+    return canvas;
+}
 
-    // Calculate centering offset
-    int offset_x = (canvas_width - src->width) / 2;
-    int offset_y = (canvas_height - src->height) / 2;
+// Decode an image file to RGBA at its own size
+image_data_t* ww_decode_image(const char *path) {
+    return ww_decode_image_scaled(path, 0, 0);
+}
 
-    // Copy image to center of canvas
-    for (int y = 0; y < src->height && (y + offset_y) < canvas_height; y++) {
-        if (y + offset_y < 0) continue;
-        
-        for (int x = 0; x < src->width && (x + offset_x) < canvas_width; x++) {
-            if (x + offset_x < 0) continue;
-            
-            int src_idx = (y * src->width + x) * 4;
-            int dst_idx = ((y + offset_y) * canvas_width + (x + offset_x)) * 4;
-            
-            canvas->data[dst_idx + 0] = src->data[src_idx + 0];
-            canvas->data[dst_idx + 1] = src->data[src_idx + 1];
-            canvas->data[dst_idx + 2] = src->data[src_idx + 2];
-            canvas->data[dst_idx + 3] = src->data[src_idx + 3];
+// Decode an image file to RGBA, letting decoders that can shrink while
+// decoding (JPEG, WebP) stop at the smallest size no smaller than min_width x
+// min_height. Others, or 0 for either, give the full size.
+image_data_t* ww_decode_image_scaled(const char *path, int min_width, int min_height) {
+    if (!path) {
+        return nullptr;
+    }
+    
+    struct decode_dest dest = {};
+    dest.min_width = min_width;
+    dest.min_height = min_height;
+    if (!decode_file(path, &dest)) {
+        return nullptr;
+    }
+    return dest.img;
+}
+
+// The smallest decoded size of an image that still renders at an output
+// size without losing detail, i.e. the size the render scales it to.
+// Centre and tile show pixels 1:1, so they need all of them.
+void ww_render_source_size(int image_width, int image_height, int output_width, int output_height,
+                           int mode, int *width, int *height) {
+    *width = image_width;
+    *height = image_height;
+    
+    if (mode == WW_MODE_STRETCH) {
+        if (output_width < image_width) *width = output_width;
+        if (output_height < image_height) *height = output_height;
+    } else if (mode == WW_MODE_FIT || mode == WW_MODE_FILL) {
+        struct render_layout layout;
+        layout_render(image_width, image_height, output_width, output_height, mode, &layout);
+        if (layout.scaled_width < image_width || layout.scaled_height < image_height) {
+            *width = layout.scaled_width < image_width ? layout.scaled_width : image_width;
+            *height = layout.scaled_height < image_height ? layout.scaled_height : image_height;
         }
     }
+}
 
-    return canvas;
+// Decode an image file straight into a caller's buffer, which must be
+// exactly the image's size. bgra swaps red and blue on the way in.
+int ww_decode_image_into(const char *path, uint8_t *dst, int width, int height,
+                         size_t stride, bool bgra) {
+    if (!path || !dst) {
+        return -1;
+    }
+    
+    struct decode_dest dest = {};
+    dest.data = dst;
+    dest.stride = stride;
+    dest.width = width;
+    dest.height = height;
+    dest.bgra = bgra;
+    return decode_file(path, &dest) ? 0 : -1;
 }
 
-// Public API for loading and processing images with scaling mode
-image_data_t* ww_load_image_mode(const char *path, int output_width, int output_height, int mode, uint32_t bg_color) {
-    // Check file type
+// Read an image's dimensions from its header without decoding it
+int ww_probe_image(const char *path, int *width, int *height) {
+    if (!path) {
+        return -1;
+    }
+    
     const char *ext = strrchr(path, '.');
-    image_data_t *img = nullptr;
+    ext = ext ? ext + 1 : "";
     
-    if (ext) {
-        ext++;
+    if (strcasecmp(ext, "webp") == 0 || strcasecmp(ext, "jxl") == 0 || strcasecmp(ext, "ff") == 0) {
+        // The size is near the start of all three
+        uint8_t head[65536];
+        FILE *file = fopen(path, "rb");
+        if (!file) {
+            return -1;
+        }
+        size_t len = fread(head, 1, sizeof(head), file);
+        fclose(file);
+        
         if (strcasecmp(ext, "webp") == 0) {
-            img = load_webp(path);
-        } else if (strcasecmp(ext, "tiff") == 0 || strcasecmp(ext, "tif") == 0) {
-            img = load_tiff(path);
-        } else if (strcasecmp(ext, "jxl") == 0) {
-            img = load_jxl(path);
-        } else if (strcasecmp(ext, "ff") == 0) {
-            img = load_farbfeld(path);
+            return WebPGetInfo(head, len, width, height) ? 0 : -1;
         }
+        
+        if (strcasecmp(ext, "ff") == 0) {
+            if (len < 16 || memcmp(head, "farbfeld", 8) != 0) {
+                return -1;
+            }
+            uint32_t w_be, h_be;
+            memcpy(&w_be, head + 8, 4);
+            memcpy(&h_be, head + 12, 4);
+            *width = (int)__builtin_bswap32(w_be);
+            *height = (int)__builtin_bswap32(h_be);
+            return *width > 0 && *height > 0 ? 0 : -1;
+        }
+        
+        auto dec = JxlDecoderMake(nullptr);
+        JxlBasicInfo info;
+        if (!dec ||
+            JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_BASIC_INFO) != JXL_DEC_SUCCESS ||
+            JxlDecoderSetInput(dec.get(), head, len) != JXL_DEC_SUCCESS ||
+            JxlDecoderProcessInput(dec.get()) != JXL_DEC_BASIC_INFO ||
+            JxlDecoderGetBasicInfo(dec.get(), &info) != JXL_DEC_SUCCESS) {
+            return -1;
+        }
+        *width = (int)info.xsize;
+        *height = (int)info.ysize;
+        return 0;
     }
     
-    // Fall back to stb_image for other formats
-    if (!img) {
-        img = load_image(path);
-    }
-    if (!img) {
-        return nullptr;
+    if (strcasecmp(ext, "tiff") == 0 || strcasecmp(ext, "tif") == 0) {
+        TIFF *tif = TIFFOpen(path, "r");
+        if (!tif) {
+            return -1;
+        }
+        uint32_t tw = 0, th = 0;
+        bool ok = TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &tw) &&
+                  TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &th) &&
+                  tw > 0 && th > 0 && tw <= INT32_MAX && th <= INT32_MAX;
+        TIFFClose(tif);
+        *width = (int)tw;
+        *height = (int)th;
+        return ok ? 0 : -1;
     }
+    
+    int channels;
+    return stbi_info(path, width, height, &channels) ? 0 : -1;
+}
 
-    // Handle different scaling modes
-    image_data_t *result = nullptr;
+// Find the thumbnail a camera embeds in a JPEG's EXIF block: IFD1 of the
+// APP1 segment's TIFF structure points at a small JPEG of its own
+static bool find_exif_thumbnail(const uint8_t *data, size_t size, const uint8_t **thumb, size_t *thumb_size) {
+    if (size < 4 || data[0] != 0xFF || data[1] != 0xD8) {
+        return false;
+    }
     
-    switch (mode) {
-        case 0: // WW_MODE_FIT - scale to fit with letterboxing
-        {
-            if (img->width == output_width && img->height == output_height) {
-                return img;
-            }
-            
-            image_data_t *scaled = scale_image(img, output_width, output_height, true);
-            if (img->data) free(img->data);
-            free(img);
+    size_t pos = 2;
+    while (pos + 4 <= size && data[pos] == 0xFF) {
+        uint8_t marker = data[pos + 1];
+        size_t len = ((size_t)data[pos + 2] << 8) | data[pos + 3];
+        // Image data follows the scan header; metadata comes before it
+        if (marker == 0xDA || len < 2 || pos + 2 + len > size) {
+            return false;
+        }
+        
+        const uint8_t *seg = data + pos + 4;
+        size_t seg_len = len - 2;
+        if (marker == 0xE1 && seg_len > 14 && memcmp(seg, "Exif\0\0", 6) == 0) {
+            const uint8_t *tiff = seg + 6;
+            size_t tiff_len = seg_len - 6;
+            bool le = tiff[0] == 'I';
+            auto u16 = [&](size_t off) -> uint32_t {
+                return le ? tiff[off] | tiff[off + 1] << 8 : tiff[off] << 8 | tiff[off + 1];
+            };
+            auto u32 = [&](size_t off) -> uint32_t {
+                return le ? u16(off) | u16(off + 2) << 16 : u16(off) << 16 | u16(off + 2);
+            };
             
-            if (!scaled) return nullptr;
+            // IFD0, then the offset of IFD1 just past its entries
+            size_t ifd = u32(4);
+            if (ifd + 2 > tiff_len) {
+                return false;
+            }
+            size_t next = ifd + 2 + 12 * (size_t)u16(ifd);
+            if (next + 4 > tiff_len) {
+                return false;
+            }
+            ifd = u32(next);
+            if (ifd == 0 || ifd + 2 > tiff_len) {
+                return false;
+            }
             
-            if (scaled->width != output_width || scaled->height != output_height) {
-                result = center_image(scaled, output_width, output_height, bg_color);
-                if (scaled->data) free(scaled->data);
-                free(scaled);
-            } else {
-                result = scaled;
+            size_t offset = 0, length = 0;
+            int count = (int)u16(ifd);
+            for (int i = 0; i < count && ifd + 2 + 12 * (size_t)(i + 1) <= tiff_len; i++) {
+                size_t entry = ifd + 2 + 12 * (size_t)i;
+                uint32_t tag = u16(entry);
+                if (tag == 0x0201) {
+                    offset = u32(entry + 8);   // JPEGInterchangeFormat
+                } else if (tag == 0x0202) {
+                    length = u32(entry + 8);   // JPEGInterchangeFormatLength
+                }
             }
-            break;
+            if (offset == 0 || length == 0 || offset > tiff_len || length > tiff_len - offset) {
+                return false;
+            }
+            *thumb = tiff + offset;
+            *thumb_size = length;
+            return true;
         }
-        
-        case 1: // WW_MODE_FILL - scale to fill, crop if needed
-        {
-            float img_aspect = (float)img->width / (float)img->height;
-            float out_aspect = (float)output_width / (float)output_height;
-            
-            int scale_width, scale_height;
-            if (img_aspect > out_aspect) {
-                // Image is wider - scale by height
-                scale_height = output_height;
-                scale_width = (int)(output_height * img_aspect);
+        pos += 2 + len;
+    }
+    return false;
+}
+
+// A quick, low-resolution stand-in for an image, from what the file
+// already carries: a JPEG's EXIF thumbnail or 1/8-scale decode, or a JPEG
+// XL's DC pass. Returns
+// nullptr when there is none, or when its shape is not the image's (EXIF
+// thumbnails are often padded to 4:3), since it is shown in its place.
+// *full is set when a JPEG XL without a DC pass had to be decoded whole:
+// the result is then the image itself, and no preview of it.
+image_data_t* ww_decode_preview(const char *path, int width, int height, bool *full) {
+    *full = false;
+    if (!path || width <= 0 || height <= 0) {
+        return nullptr;
+    }
+    
+    const char *ext = strrchr(path, '.');
+    ext = ext ? ext + 1 : "";
+    image_data_t *img = nullptr;
+    
+    if (strcasecmp(ext, "jpg") == 0 || strcasecmp(ext, "jpeg") == 0) {
+        ww_mapped_file_t file = {};
+        if (!ww_map_file(path, &file, "JPEG")) {
+            return nullptr;
+        }
+        const uint8_t *thumb;
+        size_t thumb_size;
+        int tw, th, channels;
+        uint8_t *pixels;
+        if (find_exif_thumbnail(file.data, file.size, &thumb, &thumb_size) &&
+            (pixels = stbi_load_from_memory(thumb, (int)thumb_size, &tw, &th, &channels, 4))) {
+            img = (image_data_t*)malloc(sizeof(image_data_t));
+            if (img) {
+                init_image(img, pixels, tw, th);
             } else {
-                // Image is taller - scale by width
-                scale_width = output_width;
-                scale_height = (int)(output_width / img_aspect);
+                stbi_image_free(pixels);
             }
-            
-            image_data_t *scaled = scale_image(img, scale_width, scale_height, false);
-            if (img->data) free(img->data);
-            free(img);
-            
-            if (!scaled) return nullptr;
-            
-            // Crop to output size if needed
-            if (scaled->width != output_width || scaled->height != output_height) {
-                result = center_image(scaled, output_width, output_height, bg_color);
-                if (scaled->data) free(scaled->data);
-                free(scaled);
+        }
+        ww_unmap_file(&file);
+        
+        // No thumbnail: an 1/8-scale decode, which skips most of the IDCT
+        if (!img) {
+            struct decode_dest dest = {};
+            dest.min_width = 1;
+            dest.min_height = 1;
+            if (load_jpeg(path, &dest)) {
+                img = dest.img;
             } else {
-                result = scaled;
+                dest_reset(&dest);
             }
-            break;
         }
+    } else if (strcasecmp(ext, "jxl") == 0) {
+        struct decode_dest dest = {};
+        dest.preview = true;
+        if (load_jxl(path, &dest)) {
+            img = dest.img;
+            *full = !dest.preview;
+        } else {
+            dest_reset(&dest);
+        }
+    }
+    
+    // Within a couple of percent of the image's aspect ratio
+    if (img && fabsf((float)img->width * height / ((float)img->height * width) - 1.0f) > 0.02f) {
+        ww_free_image(img);
+        img = nullptr;
+        *full = false;
+    }
+    return img;
+}
+
+// Render a decoded image, or the window of it that a render needs, at an
+// output size
+static image_data_t* render_decoded(image_data_t *img, const struct source_window *window,
+                                    int output_width, int output_height, int mode, uint32_t bg_color) {
+    bool whole = img->width == window->full_width && img->height == window->full_height;
+    
+    // Every mode is the identity on an image that is already output-sized
+    if (whole && img->width == output_width && img->height == output_height) {
+        return ww_ref_image(img);
+    }
+    
+    switch (mode) {
+        case WW_MODE_FIT:
+        case WW_MODE_FILL:
+        case WW_MODE_STRETCH:
+            break;
+        
+        case WW_MODE_CENTER: // no scaling, just center
+            return center_image(img, window, output_width, output_height, bg_color);
         
-        case 2: // WW_MODE_STRETCH - stretch to fill
-        {
-            result = scale_image(img, output_width, output_height, false);
-            if (img->data) free(img->data);
-            free(img);
+        case WW_MODE_TILE: // repeat image to fill; a window always starts at the top left
+            return tile_image(img, output_width, output_height);
+        
+        default:
+            return nullptr;
+    }
+    
+    struct render_layout layout;
+    layout_render(window->full_width, window->full_height, output_width, output_height, mode, &layout);
+    
+    // Already the right size along both axes: only a crop is left
+    if (layout.scaled_width == window->full_width && layout.scaled_height == window->full_height &&
+        layout.draw_width == output_width && layout.draw_height == output_height) {
+        return ww_view_image(img, layout.crop_x - window->x, layout.crop_y - window->y,
+                             output_width, output_height);
+    }
+    
+    image_data_t *result = ww_alloc_image(output_width, output_height);
+    if (!result) {
+        return nullptr;
+    }
+    
+    // Only the letterbox bars get the background, and the image is scaled
+    // straight into its place between them. Cropped-off parts of the
+    // scaled image are never computed.
+    fill_around(result, layout.x, layout.y, layout.draw_width, layout.draw_height, bg_color);
+    
+    if (ww_scale_rgba_window(img->data, window->full_width, window->full_height, img->stride,
+                             window->x, window->y, img->width, img->height,
+                             layout.scaled_width, layout.scaled_height, layout.crop_x, layout.crop_y,
+                             result->data + result->stride * layout.y + (size_t)layout.x * 4,
+                             layout.draw_width, layout.draw_height, result->stride,
+                             choose_filter(window->full_width, layout.scaled_width)) != 0) {
+        ww_free_image(result);
+        return nullptr;
+    }
+    
+    return result;
+}
+
+// Produce an output-sized image from a decoded one. The source is left
+// alone, so one decode can be rendered for several outputs; the result may
+// share its pixels, but holds its own reference.
+image_data_t* ww_render_image(image_data_t *img, int output_width, int output_height, int mode, uint32_t bg_color) {
+    if (!img || !img->data) {
+        return nullptr;
+    }
+    
+    struct source_window window = { 0, 0, img->width, img->height };
+    return render_decoded(img, &window, output_width, output_height, mode, bg_color);
+}
+
+// Copy the rect at (x, y) of img into dst moved by (offset_x, offset_y),
+// as far as it lands inside dst; the rect becomes the part of dst written
+static void copy_shifted(const image_data_t *img, image_data_t *dst, int offset_x, int offset_y,
+                         int *x, int *y, int *width, int *height) {
+    int x0 = *x + offset_x > 0 ? *x + offset_x : 0;
+    int y0 = *y + offset_y > 0 ? *y + offset_y : 0;
+    int x1 = *x + *width + offset_x < dst->width ? *x + *width + offset_x : dst->width;
+    int y1 = *y + *height + offset_y < dst->height ? *y + *height + offset_y : dst->height;
+    if (x0 >= x1 || y0 >= y1) {
+        *width = 0;
+        *height = 0;
+        return;
+    }
+    
+    for (int row = y0; row < y1; row++) {
+        memcpy(dst->data + dst->stride * row + (size_t)x0 * 4,
+               img->data + img->stride * (row - offset_y) + (size_t)(x0 - offset_x) * 4,
+               (size_t)(x1 - x0) * 4);
+    }
+    *x = x0;
+    *y = y0;
+    *width = x1 - x0;
+    *height = y1 - y0;
+}
+
+// Bring dst, an earlier ww_render_image() of img in the same mode, up to
+// date after the rect (*x, *y, *width, *height) of img changed. Only the
+// output pixels that read from the rect are redrawn, and they come out as
+// a full render would make them; the rect comes back as the part of dst
+// redrawn. A rect covering all of img redraws all of dst, background
+// included, so dst may also start out blank.
+int ww_render_rect(image_data_t *img, image_data_t *dst, int mode, uint32_t bg_color,
+                   int *x, int *y, int *width, int *height) {
+    if (!img || !img->data || !dst || !dst->data) {
+        return -1;
+    }
+    
+    int x0 = *x > 0 ? *x : 0;
+    int y0 = *y > 0 ? *y : 0;
+    int x1 = *x + *width < img->width ? *x + *width : img->width;
+    int y1 = *y + *height < img->height ? *y + *height : img->height;
+    if (x0 >= x1 || y0 >= y1) {
+        *width = 0;
+        *height = 0;
+        return 0;
+    }
+    *x = x0;
+    *y = y0;
+    *width = x1 - x0;
+    *height = y1 - y0;
+    bool whole = *width == img->width && *height == img->height;
+    
+    struct render_layout layout;
+    switch (mode) {
+        case WW_MODE_FIT:
+        case WW_MODE_FILL:
+        case WW_MODE_STRETCH:
+            layout_render(img->width, img->height, dst->width, dst->height, mode, &layout);
             break;
-        }
         
-        case 3: // WW_MODE_CENTER - no scaling, just center
-        {
-            result = center_image(img, output_width, output_height, bg_color);
-            if (img->data) free(img->data);
-            free(img);
+        case WW_MODE_CENTER:
+            // An unscaled image in the middle, as center_image lays it out
+            layout.scaled_width = img->width;
+            layout.scaled_height = img->height;
+            layout.x = (dst->width - img->width) / 2;
+            layout.y = (dst->height - img->height) / 2;
+            layout.crop_x = layout.x < 0 ? -layout.x : 0;
+            layout.crop_y = layout.y < 0 ? -layout.y : 0;
+            layout.x = layout.x > 0 ? layout.x : 0;
+            layout.y = layout.y > 0 ? layout.y : 0;
+            layout.draw_width = img->width < dst->width ? img->width : dst->width;
+            layout.draw_height = img->height < dst->height ? img->height : dst->height;
             break;
-        }
         
-        case 4: // WW_MODE_TILE - repeat image to fill
-        {
-            result = (image_data_t*)malloc(sizeof(image_data_t));
-            if (!result) {
-                if (img->data) free(img->data);
-                free(img);
-                return nullptr;
-            }
-            
-            result->width = output_width;
-            result->height = output_height;
-            result->channels = 4;
-            result->data = (uint8_t*)malloc(output_width * output_height * 4);
-            
-            if (!result->data) {
-                free(result);
-                if (img->data) free(img->data);
-                free(img);
-                return nullptr;
-            }
-            
-            // Tile the image
-            for (int y = 0; y < output_height; y++) {
-                for (int x = 0; x < output_width; x++) {
-                    int src_x = x % img->width;
-                    int src_y = y % img->height;
-                    int src_idx = (src_y * img->width + src_x) * 4;
-                    int dst_idx = (y * output_width + x) * 4;
-                    
-                    result->data[dst_idx + 0] = img->data[src_idx + 0];
-                    result->data[dst_idx + 1] = img->data[src_idx + 1];
-                    result->data[dst_idx + 2] = img->data[src_idx + 2];
-                    result->data[dst_idx + 3] = img->data[src_idx + 3];
+        case WW_MODE_TILE: {
+            // Every copy of the rect; what changed is the box around them
+            int bx0 = dst->width, by0 = dst->height, bx1 = 0, by1 = 0;
+            for (int ty = 0; ty < dst->height; ty += img->height) {
+                for (int tx = 0; tx < dst->width; tx += img->width) {
+                    int cx = x0, cy = y0, cw = x1 - x0, ch = y1 - y0;
+                    copy_shifted(img, dst, tx, ty, &cx, &cy, &cw, &ch);
+                    if (cw > 0 && ch > 0) {
+                        bx0 = cx < bx0 ? cx : bx0;
+                        by0 = cy < by0 ? cy : by0;
+                        bx1 = cx + cw > bx1 ? cx + cw : bx1;
+                        by1 = cy + ch > by1 ? cy + ch : by1;
+                    }
                 }
             }
-            
-            if (img->data) free(img->data);
-            free(img);
-            break;
+            *x = bx0;
+            *y = by0;
+            *width = bx1 > bx0 ? bx1 - bx0 : 0;
+            *height = by1 > by0 ? by1 - by0 : 0;
+            return 0;
         }
         
         default:
-            if (img->data) free(img->data);
-            free(img);
-            return nullptr;
+            return -1;
+    }
+    
+    if (whole) {
+        fill_around(dst, layout.x, layout.y, layout.draw_width, layout.draw_height, bg_color);
+    }
+    
+    // Unscaled: the rect lands in dst as it is
+    if (layout.scaled_width == img->width && layout.scaled_height == img->height) {
+        copy_shifted(img, dst, layout.x - layout.crop_x, layout.y - layout.crop_y, x, y, width, height);
+    } else {
+        ww_filter_t filter = choose_filter(img->width, layout.scaled_width);
+        if (ww_scale_dest_rect(img->width, img->height, layout.scaled_width, layout.scaled_height,
+                               layout.crop_x, layout.crop_y, layout.draw_width, layout.draw_height,
+                               filter, x, y, width, height) != 0) {
+            return -1;
+        }
+        if (*width > 0 &&
+            ww_scale_rgba_crop(img->data, img->width, img->height, img->stride,
+                               layout.scaled_width, layout.scaled_height,
+                               layout.crop_x + *x, layout.crop_y + *y,
+                               dst->data + dst->stride * (layout.y + *y) + (size_t)(layout.x + *x) * 4,
+                               *width, *height, dst->stride, filter) != 0) {
+            return -1;
+        }
+        *x += layout.x;
+        *y += layout.y;
+    }
+    
+    if (whole) {
+        *x = 0;
+        *y = 0;
+        *width = dst->width;
+        *height = dst->height;
+    }
+    return 0;
+}
+
+// Set up a canvas and a scaler per target for a streamed decode, now that
+// the decoded size is known
+static bool begin_streams(struct decode_dest *dest) {
+    dest->streams = (ww_scale_stream**)calloc(dest->target_count, sizeof(*dest->streams));
+    dest->row = (uint8_t*)malloc((size_t)dest->width * 4);
+    if (!dest->streams || !dest->row) {
+        return false;
+    }
+    
+    for (int t = 0; t < dest->target_count; t++) {
+        ww_render_target_t *target = &dest->targets[t];
+        struct render_layout layout;
+        layout_render(dest->full_width, dest->full_height, target->width, target->height, dest->mode, &layout);
+        
+        image_data_t *img = ww_alloc_image(target->width, target->height);
+        target->img = img;
+        if (!img) {
+            return false;
+        }
+        fill_around(img, layout.x, layout.y, layout.draw_width, layout.draw_height, dest->bg_color);
+        
+        dest->streams[t] = ww_scale_stream_create(dest->full_width, dest->full_height,
+                                                  dest->x, dest->y, dest->width, dest->height,
+                                                  layout.scaled_width, layout.scaled_height,
+                                                  layout.crop_x, layout.crop_y,
+                                                  img->data + img->stride * layout.y + (size_t)layout.x * 4,
+                                                  layout.draw_width, layout.draw_height, img->stride,
+                                                  choose_filter(dest->full_width, layout.scaled_width));
+        if (!dest->streams[t]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void end_streams(struct decode_dest *dest) {
+    if (dest->streams) {
+        for (int t = 0; t < dest->target_count; t++) {
+            ww_scale_stream_destroy(dest->streams[t]);
+        }
     }
+    free(dest->streams);
+    free(dest->row);
+    dest->streams = nullptr;
+    dest->row = nullptr;
+}
 
+// Rendering one decoded source at every target size
+struct render_job {
+    image_data_t *source;
+    struct source_window window;
+    int mode;
+    uint32_t bg_color;
+    ww_render_target_t *targets;
+};
+
+static void render_target(void *ctx, int index, int thread_id) {
+    (void)thread_id;
+    struct render_job *job = (struct render_job*)ctx;
+    ww_render_target_t *target = &job->targets[index];
+    target->img = render_decoded(job->source, &job->window, target->width, target->height,
+                                 job->mode, job->bg_color);
+}
+
+// Sources bigger than this (128MiB as RGBA) are streamed when they can be
+#define WW_STREAM_PIXELS ((size_t)1 << 25)
+
+// Whether a file's loader produces rows top to bottom
+static bool can_stream(const char *path) {
+    const char *ext = strrchr(path, '.');
+    ext = ext ? ext + 1 : "";
+    return strcasecmp(ext, "jpg") == 0 || strcasecmp(ext, "jpeg") == 0 ||
+           strcasecmp(ext, "tif") == 0 || strcasecmp(ext, "tiff") == 0 ||
+           strcasecmp(ext, "ff") == 0;
+}
+
+// Render an image file at several output sizes. A big source in a format
+// that decodes in row order is streamed through the scalers, so only the
+// outputs and a few rows of it are ever held. Anything else is decoded
+// once, shrunk while decoding where the format allows, and rendered for
+// each size in parallel. Either way, decoders that can leave out what
+// fill and centre crop off (JPEG, TIFF, Farbfeld; JXL only skips the
+// copy) decode just the part that shows.
+int ww_render_file(const char *path, int mode, uint32_t bg_color,
+                   ww_render_target_t *targets, int count) {
+    if (!path || !targets || count <= 0) {
+        return -1;
+    }
+    
+    // The source only has to be as big as the largest render needs
+    int image_width = 0, image_height = 0;
+    int min_width = 0, min_height = 0;
+    bool probed = ww_probe_image(path, &image_width, &image_height) == 0;
+    for (int t = 0; t < count && probed; t++) {
+        int width, height;
+        ww_render_source_size(image_width, image_height, targets[t].width, targets[t].height,
+                              mode, &width, &height);
+        if (width > min_width) min_width = width;
+        if (height > min_height) min_height = height;
+    }
+    
+    struct decode_dest dest = {};
+    dest.min_width = min_width;
+    dest.min_height = min_height;
+    dest.targets = targets;
+    dest.target_count = count;
+    dest.mode = mode;
+    dest.bg_color = bg_color;
+    dest.stream = probed && can_stream(path) &&
+                  (mode == WW_MODE_FIT || mode == WW_MODE_FILL || mode == WW_MODE_STRETCH) &&
+                  (size_t)image_width * (size_t)image_height > WW_STREAM_PIXELS;
+    if (!decode_file(path, &dest)) {
+        return -1;
+    }
+    
+    if (dest.stream) {
+        // A loader that gave up early leaves the bottom unscaled
+        bool complete = true;
+        for (int t = 0; t < count; t++) {
+            complete = complete && ww_scale_stream_done(dest.streams[t]);
+        }
+        if (!complete) {
+            fprintf(stderr, "Image ended early: %s\n", path);
+            dest_reset(&dest);
+            return -1;
+        }
+        end_streams(&dest);
+        return 0;
+    }
+    
+    struct render_job job = {
+        dest.img, { dest.x, dest.y, dest.full_width, dest.full_height }, mode, bg_color, targets
+    };
+    ww_parallel_for(count, render_target, &job);
+    ww_free_image(dest.img);
+    
+    int result = 0;
+    for (int t = 0; t < count; t++) {
+        if (!targets[t].img) {
+            result = -1;
+        }
+    }
+    if (result != 0) {
+        for (int t = 0; t < count; t++) {
+            ww_free_image(targets[t].img);
+            targets[t].img = nullptr;
+        }
+    }
     return result;
 }
 
+// Public API for loading and processing images with scaling mode
+image_data_t* ww_load_image_mode(const char *path, int output_width, int output_height, int mode, uint32_t bg_color) {
+    ww_render_target_t target = { output_width, output_height, nullptr };
+    if (ww_render_file(path, mode, bg_color, &target, 1) != 0) {
+        return nullptr;
+    }
+    return target.img;
+}
+
 // Legacy API for backward compatibility
 image_data_t* ww_load_image(const char *path, int output_width, int output_height, bool preserve_aspect) {
     return ww_load_image_mode(path, output_width, output_height, preserve_aspect ? 0 : 2, 0x000000FF);
 }
 
 void ww_free_image(image_data_t *img) {
-    if (!img) {
+    if (!img || __atomic_sub_fetch(&img->refs, 1, __ATOMIC_ACQ_REL) > 0) {
         return;
     }
     
-    // For processed images (scaled/centered), data is malloc'd
-    if (img->data) {
+    // A view gives back its hold on the pixels; an owner frees them
+    if (img->parent) {
+        ww_free_image(img->parent);
+    } else {
         free(img->data);
     }
     free(img);
@@ -76,6 +76,8 @@ void print_usage(const char *prog_name) {
     std::cout << "                         Effects: dissolve, pixelate\n";
     std::cout << "  -d, --duration <sec>   Transition duration in seconds (default: 1.0)\n";
     std::cout << "  -f, --fps <fps>        Transition frame rate (default: 30, max: 240)\n";
+    std::cout << "  -j, --threads <n>      Limit threads used for scaling (default: all cores)\n";
+    std::cout << "  -p, --progressive      Show a quick preview first, then the full image\n";
     std::cout << "  -D, --daemon           Fork to background\n";
     std::cout << "  -L, --list-outputs     List available outputs\n";
     std::cout << "  -v, --version          Show version information\n";
@@ -144,6 +146,7 @@ int main(int argc, char *argv[])
         .transition = WW_TRANSITION_NONE,
         .transition_duration = 0.0f,
         .transition_fps = 30,
+        .progressive = false,
     };
 
     bool slideshow_mode = false;
@@ -154,6 +157,7 @@ int main(int argc, char *argv[])
     ww_transition_type_t transition_type = WW_TRANSITION_FADE;
     float transition_duration = 1.0f;
     int transition_fps = 30;
+    int max_threads = 0;
     std::vector<std::string> files;
 
     static struct option long_options[] = {
@@ -168,6 +172,8 @@ int main(int argc, char *argv[])
         {"transition",    required_argument, 0, 't'},
         {"duration",      required_argument, 0, 'd'},
         {"fps",           required_argument, 0, 'f'},
+        {"threads",       required_argument, 0, 'j'},
+        {"progressive",   no_argument,       0, 'p'},
         {"daemon",        no_argument,       0, 'D'},
         {"list-outputs",  no_argument,       0, 'L'},
         {"version",       no_argument,       0, 'v'},
@@ -180,7 +186,7 @@ int main(int argc, char *argv[])
     bool list_mode = false;
     bool color_only = false;
 
-    while ((opt = getopt_long(argc, argv, "o:m:c:lSi:rRt:d:f:DLvh", long_options, &option_index)) != -1) {
+    while ((opt = getopt_long(argc, argv, "o:m:c:lSi:rRt:d:f:j:pDLvh", long_options, &option_index)) != -1) {
         switch (opt) {
             case 'o':
                 config.output_name = optarg;
@@ -281,6 +287,16 @@ int main(int argc, char *argv[])
                     return 1;
                 }
                 break;
+            case 'j':
+                max_threads = atoi(optarg);
+                if (max_threads < 1) {
+                    std::cerr << "Error: Invalid thread count" << std::endl;
+                    return 1;
+                }
+                break;
+            case 'p':
+                config.progressive = true;
+                break;
             case 'D':
                 daemon_mode = true;
                 break;
@@ -299,6 +315,8 @@ int main(int argc, char *argv[])
         }
     }
 
+    ww_set_max_threads(max_threads);
+
     if (ww_init() != 0) {
         std::cerr << "Error: Failed to initialize: " << ww_get_error() << std::endl;
         return 1;
@@ -0,0 +1,197 @@
+#include "ww.h"
+#include <cstdlib>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+// A small persistent worker pool for splitting CPU work (scaling, pixel
+// conversion) across cores. It starts on first use with a thread per usable
+// CPU, or fewer when capped with ww_set_max_threads(). Jobs are a count of
+// independent indices; the thread that submits a job works on it too, so a
+// job submitted from inside another job's callback always makes progress,
+// even when every worker is busy.
+
+#define WW_MAX_THREADS 64
+
+struct ww_job
+{
+    ww_parallel_fn fn;
+    void *ctx;
+    int count;
+    int next;           // next index to hand out
+    int running;        // indices handed out but not finished
+    struct ww_job *link;
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+static pthread_t workers[WW_MAX_THREADS];
+static int worker_count = 0;
+static int thread_limit = 0;               // 0: every CPU we may run on
+static bool stopping = false;
+static struct ww_job *jobs = nullptr;      // jobs with indices left to hand out
+
+// 0 on the thread that set up the pool, 1..worker_count on the workers
+static thread_local int current_thread_id = 0;
+
+// Take the next index of a job. Called with pool_lock held.
+static int take_index(struct ww_job *job)
+{
+    int index = job->next++;
+    job->running++;
+
+    // Fully handed out: nobody else needs to find it
+    if (job->next == job->count) {
+        struct ww_job **p = &jobs;
+        while (*p && *p != job) {
+            p = &(*p)->link;
+        }
+        if (*p) {
+            *p = job->link;
+        }
+    }
+    return index;
+}
+
+static void *worker_main(void *arg)
+{
+    current_thread_id = (int)(intptr_t)arg;
+
+    pthread_mutex_lock(&pool_lock);
+    for (;;) {
+        // Workers past the limit sit out until it is raised again
+        while (!stopping && (!jobs || (thread_limit > 0 && current_thread_id >= thread_limit))) {
+            pthread_cond_wait(&work_cond, &pool_lock);
+        }
+        if (stopping) {
+            break;
+        }
+
+        struct ww_job *job = jobs;
+        int index = take_index(job);
+
+        pthread_mutex_unlock(&pool_lock);
+        job->fn(job->ctx, index, current_thread_id);
+        pthread_mutex_lock(&pool_lock);
+
+        job->running--;
+        if (job->next == job->count && job->running == 0) {
+            pthread_cond_broadcast(&done_cond);
+        }
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return nullptr;
+}
+
+// CPUs this process may run on, which under taskset or a cpuset can be
+// far fewer than are online
+static int usable_cpus(void)
+{
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        return CPU_COUNT(&set);
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int)cpus : 1;
+}
+
+static void start_workers(void)
+{
+    int cpus = usable_cpus();
+    pthread_mutex_lock(&pool_lock);
+    if (thread_limit > 0 && thread_limit < cpus) {
+        cpus = thread_limit;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    int wanted = cpus - 1;
+    if (wanted > WW_MAX_THREADS) {
+        wanted = WW_MAX_THREADS;
+    }
+
+    // Fewer workers than asked for is fine: the caller always helps
+    for (int i = 0; i < wanted; i++) {
+        if (pthread_create(&workers[i], nullptr, worker_main, (void*)(intptr_t)(i + 1)) != 0) {
+            break;
+        }
+        worker_count++;
+    }
+}
+
+void ww_set_max_threads(int count)
+{
+    pthread_mutex_lock(&pool_lock);
+    thread_limit = count > 0 ? count : 0;
+    pthread_cond_broadcast(&work_cond);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+int ww_parallel_threads(void)
+{
+    pthread_once(&pool_once, start_workers);
+
+    pthread_mutex_lock(&pool_lock);
+    int threads = worker_count + 1;
+    if (thread_limit > 0 && thread_limit < threads) {
+        threads = thread_limit;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return threads;
+}
+
+void ww_parallel_for(int count, ww_parallel_fn fn, void *ctx)
+{
+    if (count <= 0) {
+        return;
+    }
+
+    pthread_once(&pool_once, start_workers);
+
+    // Nothing to share
+    if (count == 1 || ww_parallel_threads() == 1) {
+        for (int i = 0; i < count; i++) {
+            fn(ctx, i, current_thread_id);
+        }
+        return;
+    }
+
+    struct ww_job job = {};
+    job.fn = fn;
+    job.ctx = ctx;
+    job.count = count;
+
+    pthread_mutex_lock(&pool_lock);
+    job.link = jobs;
+    jobs = &job;
+    pthread_cond_broadcast(&work_cond);
+
+    while (job.next < job.count) {
+        int index = take_index(&job);
+        pthread_mutex_unlock(&pool_lock);
+        fn(ctx, index, current_thread_id);
+        pthread_mutex_lock(&pool_lock);
+        job.running--;
+    }
+
+    // The job lives on this stack, so wait out indices still on workers
+    while (job.running > 0) {
+        pthread_cond_wait(&done_cond, &pool_lock);
+    }
+    pthread_mutex_unlock(&pool_lock);
+}
+
+void ww_parallel_shutdown(void)
+{
+    pthread_mutex_lock(&pool_lock);
+    stopping = true;
+    pthread_cond_broadcast(&work_cond);
+    pthread_mutex_unlock(&pool_lock);
+
+    for (int i = 0; i < worker_count; i++) {
+        pthread_join(workers[i], nullptr);
+    }
+    worker_count = 0;
+}
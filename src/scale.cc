@@ -0,0 +1,989 @@
+#include "ww.h"
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define WW_SCALE_X86 1
+#endif
+
+// Separable RGBA resampler. Each axis gets a table of fixed-point weights,
+// computed once per scale; rows are filtered horizontally into a small ring
+// as the vertical pass needs them, so the intermediate image never exists
+// in full. Kernels are plain C, SSE2 and AVX2, picked at runtime.
+
+#define WW_SCALE_BITS 14
+#define WW_SCALE_ONE (1 << WW_SCALE_BITS)
+#define WW_SCALE_ROUND (1 << (WW_SCALE_BITS - 1))
+
+// Smallest number of output rows worth handing to a worker
+#define WW_SCALE_MIN_BAND 16
+
+// Weights for one axis: output coordinate i reads source pixels
+// start[i] .. start[i] + taps - 1, weighted by coeffs[i * taps ..]
+struct ww_weights
+{
+    int taps;
+    int *start;
+    int16_t *coeffs;
+};
+
+static void free_weights(struct ww_weights *w)
+{
+    free(w->start);
+    free(w->coeffs);
+    w->start = nullptr;
+    w->coeffs = nullptr;
+}
+
+// ============================================================================
+// Weight tables
+// ============================================================================
+
+// Catmull-Rom weights for the four taps around a sample at fraction t
+static void cubic_weights(float t, float *w)
+{
+    float t2 = t * t;
+    float t3 = t2 * t;
+    w[0] = (-t3 + 2.0f * t2 - t) * 0.5f;
+    w[1] = (3.0f * t3 - 5.0f * t2 + 2.0f) * 0.5f;
+    w[2] = (-3.0f * t3 + 4.0f * t2 + t) * 0.5f;
+    w[3] = (t3 - t2) * 0.5f;
+}
+
+static float sinc(float x)
+{
+    if (x == 0.0f) {
+        return 1.0f;
+    }
+    x *= (float)M_PI;
+    return sinf(x) / x;
+}
+
+static float lanczos3(float x)
+{
+    if (x <= -3.0f || x >= 3.0f) {
+        return 0.0f;
+    }
+    return sinc(x) * sinc(x / 3.0f);
+}
+
+static float box(float x)
+{
+    return (x > -0.5f && x <= 0.5f) ? 1.0f : 0.0f;
+}
+
+// Round one output coordinate's weights to fixed point, handing the
+// rounding error to the largest tap so flat areas come out exactly flat
+static void quantize_weights(const float *weights, int taps, int16_t *c)
+{
+    int sum = 0;
+    int largest = 0;
+    for (int k = 0; k < taps; k++) {
+        c[k] = (int16_t)lrintf(weights[k] * WW_SCALE_ONE);
+        sum += c[k];
+        if (abs(c[k]) > abs(c[largest])) {
+            largest = k;
+        }
+    }
+    c[largest] = (int16_t)(c[largest] + WW_SCALE_ONE - sum);
+}
+
+static bool alloc_weights(struct ww_weights *w, int taps, int count)
+{
+    w->taps = taps;
+    w->start = (int*)malloc((size_t)count * sizeof(int));
+    w->coeffs = (int16_t*)calloc((size_t)count * taps, sizeof(int16_t));
+    if (!w->start || !w->coeffs) {
+        free_weights(w);
+        return false;
+    }
+    return true;
+}
+
+// Bilinear and bicubic sample at i * ratio with a fixed-size kernel, the
+// same positions as the old point-sampled scalers
+static bool build_point_weights(struct ww_weights *w, int src_size, int dst_size,
+                                int first_out, int count, ww_filter_t filter)
+{
+    int kernel_taps = filter == WW_FILTER_BICUBIC ? 4 : 2;
+    int taps = kernel_taps < src_size ? kernel_taps : src_size;
+    if (!alloc_weights(w, taps, count)) {
+        return false;
+    }
+
+    float ratio = (float)src_size / (float)dst_size;
+    for (int n = 0; n < count; n++) {
+        int i = first_out + n;
+        float pos = i * ratio;
+        int base = (int)pos;
+        float t = pos - base;
+
+        float kernel[4];
+        int first;
+        if (filter == WW_FILTER_BICUBIC) {
+            cubic_weights(t, kernel);
+            first = base - 1;
+        } else {
+            kernel[0] = 1.0f - t;
+            kernel[1] = t;
+            first = base;
+        }
+
+        // Taps past the edges read the edge pixel, so fold them into a
+        // window that stays inside the image
+        int start = first;
+        if (start > src_size - taps) {
+            start = src_size - taps;
+        }
+        if (start < 0) {
+            start = 0;
+        }
+
+        float folded[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+        for (int k = 0; k < kernel_taps; k++) {
+            int s = first + k;
+            s = s < 0 ? 0 : (s >= src_size ? src_size - 1 : s);
+            folded[s - start] += kernel[k];
+        }
+
+        quantize_weights(folded, taps, w->coeffs + (size_t)n * taps);
+        w->start[n] = start;
+    }
+
+    return true;
+}
+
+// Box and Lanczos-3 are centred on output pixel centres, and when
+// shrinking their support widens with the scale factor, so every source
+// pixel contributes to the output and nothing aliases. Box at large
+// factors is a plain area average. Taps that fall off the image are
+// dropped and the rest renormalised.
+static bool build_window_weights(struct ww_weights *w, int src_size, int dst_size,
+                                 int first_out, int count, ww_filter_t filter)
+{
+    float (*kernel)(float) = filter == WW_FILTER_BOX ? box : lanczos3;
+    float radius = filter == WW_FILTER_BOX ? 0.5f : 3.0f;
+
+    float ratio = (float)src_size / (float)dst_size;
+    float filter_scale = ratio > 1.0f ? ratio : 1.0f;
+    float support = radius * filter_scale;
+
+    int taps = (int)ceilf(support) * 2 + 1;
+    if (taps > src_size) {
+        taps = src_size;
+    }
+    if (!alloc_weights(w, taps, count)) {
+        return false;
+    }
+
+    float *weights = (float*)malloc(taps * sizeof(float));
+    if (!weights) {
+        free_weights(w);
+        return false;
+    }
+
+    for (int n = 0; n < count; n++) {
+        float center = (first_out + n + 0.5f) * ratio;
+        int lo = (int)floorf(center - support + 0.5f);
+        int hi = (int)floorf(center + support + 0.5f);
+        if (lo < 0) {
+            lo = 0;
+        }
+        if (hi > src_size) {
+            hi = src_size;
+        }
+        if (hi - lo > taps) {
+            hi = lo + taps;
+        }
+
+        // Every output coordinate uses the same tap count, so the window
+        // may start before lo; those leading taps get no weight
+        int start = lo < src_size - taps ? lo : src_size - taps;
+
+        float sum = 0.0f;
+        for (int k = 0; k < taps; k++) {
+            int s = start + k;
+            weights[k] = 0.0f;
+            if (s >= lo && s < hi) {
+                weights[k] = kernel((s + 0.5f - center) / filter_scale);
+                sum += weights[k];
+            }
+        }
+        if (sum == 0.0f) {
+            // Nothing landed in the window; use the nearest pixel
+            int nearest = (int)center;
+            nearest = nearest < start ? start : (nearest >= start + taps ? start + taps - 1 : nearest);
+            weights[nearest - start] = 1.0f;
+            sum = 1.0f;
+        }
+        for (int k = 0; k < taps; k++) {
+            weights[k] /= sum;
+        }
+
+        quantize_weights(weights, taps, w->coeffs + (size_t)n * taps);
+        w->start[n] = start;
+    }
+
+    free(weights);
+    return true;
+}
+
+// Weights for output coordinates first_out .. first_out + count - 1 of a
+// scale from src_size to dst_size
+static bool build_weights(struct ww_weights *w, int src_size, int dst_size,
+                          int first_out, int count, ww_filter_t filter)
+{
+    if (filter == WW_FILTER_BOX || filter == WW_FILTER_LANCZOS3) {
+        return build_window_weights(w, src_size, dst_size, first_out, count, filter);
+    }
+    return build_point_weights(w, src_size, dst_size, first_out, count, filter);
+}
+
+// Make the weights read from a window of the source that starts at
+// offset instead of from the whole of it. False if they reach outside a
+// window of size pixels.
+static bool shift_weights(struct ww_weights *w, int count, int offset, int size)
+{
+    for (int n = 0; n < count; n++) {
+        w->start[n] -= offset;
+        if (w->start[n] < 0 || w->start[n] + w->taps > size) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The span of source pixels that output coordinates first_out ..
+// first_out + count - 1 read
+static bool weights_span(int src_size, int dst_size, int first_out, int count,
+                         ww_filter_t filter, int *first, int *size)
+{
+    struct ww_weights w = {};
+    if (!build_weights(&w, src_size, dst_size, first_out, count, filter)) {
+        return false;
+    }
+    int lo = w.start[0];
+    int hi = w.start[0] + w.taps;
+    for (int n = 1; n < count; n++) {
+        lo = w.start[n] < lo ? w.start[n] : lo;
+        hi = w.start[n] + w.taps > hi ? w.start[n] + w.taps : hi;
+    }
+    free_weights(&w);
+    *first = lo;
+    *size = hi - lo;
+    return true;
+}
+
+// The output coordinates among first_out .. first_out + count - 1 that
+// read any of source pixels *first .. *first + *size - 1, in place and
+// relative to first_out; an empty span when none do
+static bool weights_reach(int src_size, int dst_size, int first_out, int count,
+                          ww_filter_t filter, int *first, int *size)
+{
+    struct ww_weights w = {};
+    if (!build_weights(&w, src_size, dst_size, first_out, count, filter)) {
+        return false;
+    }
+    int lo = count;
+    int hi = 0;
+    for (int n = 0; n < count; n++) {
+        if (w.start[n] < *first + *size && w.start[n] + w.taps > *first) {
+            lo = n < lo ? n : lo;
+            hi = n + 1;
+        }
+    }
+    free_weights(&w);
+    *first = lo < hi ? lo : 0;
+    *size = lo < hi ? hi - lo : 0;
+    return true;
+}
+
+static inline uint8_t clamp_fixed(int32_t v)
+{
+    v >>= WW_SCALE_BITS;
+    return (uint8_t)(v < 0 ? 0 : (v > 255 ? 255 : v));
+}
+
+// ============================================================================
+// Kernels
+// ============================================================================
+
+// Filter one source row horizontally into dst_width RGBA pixels
+typedef void (*ww_hpass_fn)(const uint8_t *src, uint8_t *dst, int dst_width,
+                            const struct ww_weights *w);
+
+// Blend taps rows into one output row of bytes
+typedef void (*ww_vpass_fn)(const uint8_t *const *rows, const int16_t *coeffs, int taps,
+                            uint8_t *dst, int bytes);
+
+static void hpass_c(const uint8_t *src, uint8_t *dst, int dst_width, const struct ww_weights *w)
+{
+    int taps = w->taps;
+    for (int x = 0; x < dst_width; x++) {
+        const uint8_t *s = src + (size_t)w->start[x] * 4;
+        const int16_t *c = w->coeffs + (size_t)x * taps;
+        int32_t r = WW_SCALE_ROUND, g = WW_SCALE_ROUND, b = WW_SCALE_ROUND, a = WW_SCALE_ROUND;
+        for (int k = 0; k < taps; k++) {
+            r += s[k * 4 + 0] * c[k];
+            g += s[k * 4 + 1] * c[k];
+            b += s[k * 4 + 2] * c[k];
+            a += s[k * 4 + 3] * c[k];
+        }
+        dst[x * 4 + 0] = clamp_fixed(r);
+        dst[x * 4 + 1] = clamp_fixed(g);
+        dst[x * 4 + 2] = clamp_fixed(b);
+        dst[x * 4 + 3] = clamp_fixed(a);
+    }
+}
+
+// Bytes x .. bytes - 1 of a vertical pass, for what the SIMD loops leave
+static void vpass_tail(const uint8_t *const *rows, const int16_t *coeffs, int taps,
+                       uint8_t *dst, int x, int bytes)
+{
+    for (; x < bytes; x++) {
+        int32_t v = WW_SCALE_ROUND;
+        for (int k = 0; k < taps; k++) {
+            v += rows[k][x] * coeffs[k];
+        }
+        dst[x] = clamp_fixed(v);
+    }
+}
+
+static void vpass_c(const uint8_t *const *rows, const int16_t *coeffs, int taps,
+                    uint8_t *dst, int bytes)
+{
+    vpass_tail(rows, coeffs, taps, dst, 0, bytes);
+}
+
+#ifdef WW_SCALE_X86
+
+// Two adjacent coefficients as the 32-bit lane pmaddwd wants
+static inline int32_t coeff_pair(const int16_t *c)
+{
+    return (int32_t)((uint32_t)(uint16_t)c[0] | ((uint32_t)(uint16_t)c[1] << 16));
+}
+
+// Two adjacent RGBA pixels as [r0 r1 g0 g1 b0 b1 a0 a1] in 16 bits
+static inline __m128i load_pixel_pair(const uint8_t *p)
+{
+    __m128i v = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)p), _mm_setzero_si128());
+    return _mm_unpacklo_epi16(v, _mm_srli_si128(v, 8));
+}
+
+// One RGBA pixel as [r 0 g 0 b 0 a 0] in 16 bits
+static inline __m128i load_pixel_single(const uint8_t *p)
+{
+    int32_t px;
+    memcpy(&px, p, 4);
+    __m128i v = _mm_unpacklo_epi8(_mm_cvtsi32_si128(px), _mm_setzero_si128());
+    return _mm_unpacklo_epi16(v, _mm_setzero_si128());
+}
+
+static inline __m128i hpass_pixel_sse2(const uint8_t *s, const int16_t *c, int taps)
+{
+    __m128i acc = _mm_set1_epi32(WW_SCALE_ROUND);
+    int k = 0;
+    for (; k + 1 < taps; k += 2) {
+        __m128i px = load_pixel_pair(s + k * 4);
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(px, _mm_set1_epi32(coeff_pair(c + k))));
+    }
+    if (k < taps) {
+        __m128i px = load_pixel_single(s + k * 4);
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(px, _mm_set1_epi32((uint16_t)c[k])));
+    }
+    return _mm_srai_epi32(acc, WW_SCALE_BITS);
+}
+
+static void hpass_sse2(const uint8_t *src, uint8_t *dst, int dst_width, const struct ww_weights *w)
+{
+    int taps = w->taps;
+    for (int x = 0; x < dst_width; x++) {
+        __m128i v = hpass_pixel_sse2(src + (size_t)w->start[x] * 4,
+                                     w->coeffs + (size_t)x * taps, taps);
+        v = _mm_packs_epi32(v, v);
+        v = _mm_packus_epi16(v, v);
+        int32_t px = _mm_cvtsi128_si32(v);
+        memcpy(dst + x * 4, &px, 4);
+    }
+}
+
+static void vpass_sse2(const uint8_t *const *rows, const int16_t *coeffs, int taps,
+                       uint8_t *dst, int bytes)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int x = 0;
+    for (; x + 16 <= bytes; x += 16) {
+        __m128i acc0 = _mm_set1_epi32(WW_SCALE_ROUND);
+        __m128i acc1 = acc0, acc2 = acc0, acc3 = acc0;
+        for (int k = 0; k < taps; k += 2) {
+            __m128i r0 = _mm_loadu_si128((const __m128i*)(rows[k] + x));
+            __m128i r1 = zero;
+            __m128i w;
+            if (k + 1 < taps) {
+                r1 = _mm_loadu_si128((const __m128i*)(rows[k + 1] + x));
+                w = _mm_set1_epi32(coeff_pair(coeffs + k));
+            } else {
+                w = _mm_set1_epi32((uint16_t)coeffs[k]);
+            }
+            __m128i lo0 = _mm_unpacklo_epi8(r0, zero), hi0 = _mm_unpackhi_epi8(r0, zero);
+            __m128i lo1 = _mm_unpacklo_epi8(r1, zero), hi1 = _mm_unpackhi_epi8(r1, zero);
+            acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi16(lo0, lo1), w));
+            acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi16(lo0, lo1), w));
+            acc2 = _mm_add_epi32(acc2, _mm_madd_epi16(_mm_unpacklo_epi16(hi0, hi1), w));
+            acc3 = _mm_add_epi32(acc3, _mm_madd_epi16(_mm_unpackhi_epi16(hi0, hi1), w));
+        }
+        __m128i lo = _mm_packs_epi32(_mm_srai_epi32(acc0, WW_SCALE_BITS),
+                                     _mm_srai_epi32(acc1, WW_SCALE_BITS));
+        __m128i hi = _mm_packs_epi32(_mm_srai_epi32(acc2, WW_SCALE_BITS),
+                                     _mm_srai_epi32(acc3, WW_SCALE_BITS));
+        _mm_storeu_si128((__m128i*)(dst + x), _mm_packus_epi16(lo, hi));
+    }
+
+    vpass_tail(rows, coeffs, taps, dst, x, bytes);
+}
+
+// AVX2 filters two output pixels per step, one in each 128-bit lane
+__attribute__((target("avx2")))
+static void hpass_avx2(const uint8_t *src, uint8_t *dst, int dst_width, const struct ww_weights *w)
+{
+    int taps = w->taps;
+    int x = 0;
+    for (; x + 1 < dst_width; x += 2) {
+        const uint8_t *s0 = src + (size_t)w->start[x] * 4;
+        const uint8_t *s1 = src + (size_t)w->start[x + 1] * 4;
+        const int16_t *c0 = w->coeffs + (size_t)x * taps;
+        const int16_t *c1 = c0 + taps;
+
+        __m256i acc = _mm256_set1_epi32(WW_SCALE_ROUND);
+        int k = 0;
+        for (; k + 1 < taps; k += 2) {
+            __m256i px = _mm256_inserti128_si256(_mm256_castsi128_si256(load_pixel_pair(s0 + k * 4)),
+                                                 load_pixel_pair(s1 + k * 4), 1);
+            __m256i cw = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_set1_epi32(coeff_pair(c0 + k))),
+                                                 _mm_set1_epi32(coeff_pair(c1 + k)), 1);
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(px, cw));
+        }
+        if (k < taps) {
+            __m256i px = _mm256_inserti128_si256(_mm256_castsi128_si256(load_pixel_single(s0 + k * 4)),
+                                                 load_pixel_single(s1 + k * 4), 1);
+            __m256i cw = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_set1_epi32((uint16_t)c0[k])),
+                                                 _mm_set1_epi32((uint16_t)c1[k]), 1);
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(px, cw));
+        }
+        acc = _mm256_srai_epi32(acc, WW_SCALE_BITS);
+
+        // Lanes hold pixel x and x + 1; pack each to 4 bytes
+        __m128i v = _mm_packs_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+        v = _mm_packus_epi16(v, v);
+        _mm_storel_epi64((__m128i*)(dst + x * 4), v);
+    }
+    if (x < dst_width) {
+        __m128i v = hpass_pixel_sse2(src + (size_t)w->start[x] * 4,
+                                     w->coeffs + (size_t)x * taps, taps);
+        v = _mm_packs_epi32(v, v);
+        v = _mm_packus_epi16(v, v);
+        int32_t px = _mm_cvtsi128_si32(v);
+        memcpy(dst + x * 4, &px, 4);
+    }
+}
+
+__attribute__((target("avx2")))
+static void vpass_avx2(const uint8_t *const *rows, const int16_t *coeffs, int taps,
+                       uint8_t *dst, int bytes)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    int x = 0;
+    for (; x + 32 <= bytes; x += 32) {
+        __m256i acc0 = _mm256_set1_epi32(WW_SCALE_ROUND);
+        __m256i acc1 = acc0, acc2 = acc0, acc3 = acc0;
+        for (int k = 0; k < taps; k += 2) {
+            __m256i r0 = _mm256_loadu_si256((const __m256i*)(rows[k] + x));
+            __m256i r1 = zero;
+            __m256i w;
+            if (k + 1 < taps) {
+                r1 = _mm256_loadu_si256((const __m256i*)(rows[k + 1] + x));
+                w = _mm256_set1_epi32(coeff_pair(coeffs + k));
+            } else {
+                w = _mm256_set1_epi32((uint16_t)coeffs[k]);
+            }
+            // Unpacks and packs both work per 128-bit lane, so the byte
+            // order comes back out as it went in
+            __m256i lo0 = _mm256_unpacklo_epi8(r0, zero), hi0 = _mm256_unpackhi_epi8(r0, zero);
+            __m256i lo1 = _mm256_unpacklo_epi8(r1, zero), hi1 = _mm256_unpackhi_epi8(r1, zero);
+            acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(_mm256_unpacklo_epi16(lo0, lo1), w));
+            acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(_mm256_unpackhi_epi16(lo0, lo1), w));
+            acc2 = _mm256_add_epi32(acc2, _mm256_madd_epi16(_mm256_unpacklo_epi16(hi0, hi1), w));
+            acc3 = _mm256_add_epi32(acc3, _mm256_madd_epi16(_mm256_unpackhi_epi16(hi0, hi1), w));
+        }
+        __m256i lo = _mm256_packs_epi32(_mm256_srai_epi32(acc0, WW_SCALE_BITS),
+                                        _mm256_srai_epi32(acc1, WW_SCALE_BITS));
+        __m256i hi = _mm256_packs_epi32(_mm256_srai_epi32(acc2, WW_SCALE_BITS),
+                                        _mm256_srai_epi32(acc3, WW_SCALE_BITS));
+        _mm256_storeu_si256((__m256i*)(dst + x), _mm256_packus_epi16(lo, hi));
+    }
+
+    vpass_tail(rows, coeffs, taps, dst, x, bytes);
+}
+
+#endif
+
+static ww_hpass_fn hpass = nullptr;
+static ww_vpass_fn vpass = nullptr;
+
+static void pick_kernels_once(void)
+{
+    hpass = hpass_c;
+    vpass = vpass_c;
+#ifdef WW_SCALE_X86
+    // SSE2 is part of x86-64
+    hpass = hpass_sse2;
+    vpass = vpass_sse2;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        hpass = hpass_avx2;
+        vpass = vpass_avx2;
+    }
+#endif
+}
+
+static void pick_kernels(void)
+{
+    static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+    pthread_once(&kernels_once, pick_kernels_once);
+}
+
+// Colour fills are store-bound, so 16-byte stores are as good as it gets
+void ww_fill_rgba(uint8_t *dst, size_t pixels, uint32_t color)
+{
+    uint8_t px[4] = {
+        (uint8_t)(color >> 24), (uint8_t)(color >> 16), (uint8_t)(color >> 8), (uint8_t)color,
+    };
+    uint32_t value;
+    memcpy(&value, px, 4);
+
+    size_t i = 0;
+#ifdef WW_SCALE_X86
+    __m128i v = _mm_set1_epi32((int32_t)value);
+    for (; i + 4 <= pixels; i += 4) {
+        _mm_storeu_si128((__m128i*)(dst + i * 4), v);
+    }
+#endif
+    for (; i < pixels; i++) {
+        memcpy(dst + i * 4, &value, 4);
+    }
+}
+
+// RGBA <-> BGRA. Works in place: each 16-byte load is finished with
+// before the store that could overlap it.
+void ww_swizzle_rgba(uint8_t *dst, const uint8_t *src, size_t pixels)
+{
+    size_t i = 0;
+#ifdef WW_SCALE_X86
+    const __m128i ga_mask = _mm_set1_epi32((int32_t)0xFF00FF00);
+    const __m128i low_mask = _mm_set1_epi32(0x000000FF);
+    for (; i + 4 <= pixels; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i * 4));
+        __m128i ga = _mm_and_si128(v, ga_mask);
+        __m128i r = _mm_slli_epi32(_mm_and_si128(v, low_mask), 16);
+        __m128i b = _mm_and_si128(_mm_srli_epi32(v, 16), low_mask);
+        _mm_storeu_si128((__m128i*)(dst + i * 4), _mm_or_si128(ga, _mm_or_si128(r, b)));
+    }
+#endif
+    for (; i < pixels; i++) {
+        uint8_t r = src[i * 4 + 0];
+        uint8_t b = src[i * 4 + 2];
+        dst[i * 4 + 0] = b;
+        dst[i * 4 + 1] = src[i * 4 + 1];
+        dst[i * 4 + 2] = r;
+        dst[i * 4 + 3] = src[i * 4 + 3];
+    }
+}
+
+// Farbfeld samples are 16-bit big-endian, so the byte worth keeping comes
+// first. Read as little-endian words it is the low byte, and a mask and a
+// saturating pack keep exactly that: 32 bytes in, 16 out.
+void ww_narrow_rgba16be(uint8_t *dst, const uint8_t *src, size_t pixels)
+{
+    size_t i = 0;
+    size_t samples = pixels * 4;
+#ifdef WW_SCALE_X86
+    const __m128i low_mask = _mm_set1_epi16(0x00FF);
+    for (; i + 16 <= samples; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(src + i * 2));
+        __m128i b = _mm_loadu_si128((const __m128i*)(src + i * 2 + 16));
+        a = _mm_and_si128(a, low_mask);
+        b = _mm_and_si128(b, low_mask);
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(a, b));
+    }
+#endif
+    for (; i < samples; i++) {
+        dst[i] = src[i * 2];
+    }
+}
+
+// ============================================================================
+// Driver
+// ============================================================================
+
+struct ww_scale_job
+{
+    const uint8_t *src;
+    size_t src_stride;
+    uint8_t *dst;
+    int dst_width;
+    size_t dst_stride;
+    struct ww_weights horizontal;
+    struct ww_weights vertical;
+    int dst_height;
+    int band_rows;
+    bool failed;
+};
+
+// Scale one band of output rows. Each band keeps its own ring of
+// horizontally filtered rows, indexed by source row modulo the tap count:
+// the rows a given output row reads are consecutive, so they never collide.
+static void scale_band(void *ctx, int band, int thread_id)
+{
+    (void)thread_id;
+    struct ww_scale_job *job = (struct ww_scale_job*)ctx;
+    int taps = job->vertical.taps;
+    size_t row_bytes = (size_t)job->dst_width * 4;
+
+    // Downscaling filters widen with the scale factor, so the tap count
+    // has no fixed bound
+    uint8_t *ring = (uint8_t*)malloc(row_bytes * taps);
+    int *ring_row = (int*)malloc(taps * sizeof(int));
+    const uint8_t **rows = (const uint8_t**)malloc(taps * sizeof(*rows));
+    if (!ring || !ring_row || !rows) {
+        __atomic_store_n(&job->failed, true, __ATOMIC_RELAXED);
+        free(ring);
+        free(ring_row);
+        free(rows);
+        return;
+    }
+    for (int k = 0; k < taps; k++) {
+        ring_row[k] = -1;
+    }
+
+    int y0 = band * job->band_rows;
+    int y1 = y0 + job->band_rows < job->dst_height ? y0 + job->band_rows : job->dst_height;
+    for (int y = y0; y < y1; y++) {
+        int start = job->vertical.start[y];
+        for (int k = 0; k < taps; k++) {
+            int sy = start + k;
+            int slot = sy % taps;
+            uint8_t *row = ring + row_bytes * slot;
+            if (ring_row[slot] != sy) {
+                hpass(job->src + job->src_stride * sy, row, job->dst_width, &job->horizontal);
+                ring_row[slot] = sy;
+            }
+            rows[k] = row;
+        }
+        vpass(rows, job->vertical.coeffs + (size_t)y * taps, taps,
+              job->dst + job->dst_stride * y, (int)row_bytes);
+    }
+
+    free(ring);
+    free(ring_row);
+    free(rows);
+}
+
+// The rectangle of the source that ww_scale_rgba_crop reads for the same
+// arguments. Decoding only that much of an image is enough to scale it.
+int ww_scale_source_rect(int src_width, int src_height, int scaled_width, int scaled_height,
+                         int crop_x, int crop_y, int dst_width, int dst_height, ww_filter_t filter,
+                         int *x, int *y, int *width, int *height)
+{
+    if (src_width <= 0 || src_height <= 0 || dst_width <= 0 || dst_height <= 0 ||
+        crop_x < 0 || crop_y < 0 ||
+        crop_x + dst_width > scaled_width || crop_y + dst_height > scaled_height) {
+        return -1;
+    }
+    if (!weights_span(src_width, scaled_width, crop_x, dst_width, filter, x, width) ||
+        !weights_span(src_height, scaled_height, crop_y, dst_height, filter, y, height)) {
+        return -1;
+    }
+    return 0;
+}
+
+// The other way round: the rectangle of dst that ww_scale_rgba_crop
+// computes from the source rectangle (*x, *y, *width, *height), in place.
+// Redrawing just that much of dst after that much of the source changed
+// gives the same pixels as scaling it all again.
+int ww_scale_dest_rect(int src_width, int src_height, int scaled_width, int scaled_height,
+                       int crop_x, int crop_y, int dst_width, int dst_height, ww_filter_t filter,
+                       int *x, int *y, int *width, int *height)
+{
+    if (src_width <= 0 || src_height <= 0 || dst_width <= 0 || dst_height <= 0 ||
+        crop_x < 0 || crop_y < 0 ||
+        crop_x + dst_width > scaled_width || crop_y + dst_height > scaled_height) {
+        return -1;
+    }
+    if (!weights_reach(src_width, scaled_width, crop_x, dst_width, filter, x, width) ||
+        !weights_reach(src_height, scaled_height, crop_y, dst_height, filter, y, height)) {
+        return -1;
+    }
+    if (*width == 0 || *height == 0) {
+        *width = 0;
+        *height = 0;
+    }
+    return 0;
+}
+
+int ww_scale_rgba_crop(const uint8_t *src, int src_width, int src_height, size_t src_stride,
+                       int scaled_width, int scaled_height, int crop_x, int crop_y,
+                       uint8_t *dst, int dst_width, int dst_height, size_t dst_stride,
+                       ww_filter_t filter)
+{
+    return ww_scale_rgba_window(src, src_width, src_height, src_stride,
+                                0, 0, src_width, src_height,
+                                scaled_width, scaled_height, crop_x, crop_y,
+                                dst, dst_width, dst_height, dst_stride, filter);
+}
+
+int ww_scale_rgba_window(const uint8_t *src, int src_width, int src_height, size_t src_stride,
+                         int window_x, int window_y, int window_width, int window_height,
+                         int scaled_width, int scaled_height, int crop_x, int crop_y,
+                         uint8_t *dst, int dst_width, int dst_height, size_t dst_stride,
+                         ww_filter_t filter)
+{
+    if (!src || !dst || src_width <= 0 || src_height <= 0 || dst_width <= 0 || dst_height <= 0) {
+        return -1;
+    }
+    if (crop_x < 0 || crop_y < 0 ||
+        crop_x + dst_width > scaled_width || crop_y + dst_height > scaled_height) {
+        return -1;
+    }
+
+    pick_kernels();
+
+    struct ww_scale_job job = {};
+    job.src = src;
+    job.src_stride = src_stride;
+    job.dst = dst;
+    job.dst_width = dst_width;
+    job.dst_stride = dst_stride;
+    job.dst_height = dst_height;
+
+    // Only the visible window gets weights, so nothing outside it is
+    // ever computed
+    if (!build_weights(&job.horizontal, src_width, scaled_width, crop_x, dst_width, filter) ||
+        !build_weights(&job.vertical, src_height, scaled_height, crop_y, dst_height, filter) ||
+        !shift_weights(&job.horizontal, dst_width, window_x, window_width) ||
+        !shift_weights(&job.vertical, dst_height, window_y, window_height)) {
+        free_weights(&job.horizontal);
+        free_weights(&job.vertical);
+        return -1;
+    }
+
+    // A few bands per thread keeps the workers evenly loaded; each band
+    // re-filters at most taps - 1 rows that its neighbour also filtered
+    int bands = ww_parallel_threads() * 4;
+    int max_bands = (dst_height + WW_SCALE_MIN_BAND - 1) / WW_SCALE_MIN_BAND;
+    if (bands > max_bands) {
+        bands = max_bands;
+    }
+    job.band_rows = (dst_height + bands - 1) / bands;
+    bands = (dst_height + job.band_rows - 1) / job.band_rows;
+
+    ww_parallel_for(bands, scale_band, &job);
+
+    free_weights(&job.horizontal);
+    free_weights(&job.vertical);
+    return job.failed ? -1 : 0;
+}
+
+int ww_scale_rgba(const uint8_t *src, int src_width, int src_height, size_t src_stride,
+                  uint8_t *dst, int dst_width, int dst_height, size_t dst_stride,
+                  ww_filter_t filter)
+{
+    return ww_scale_rgba_crop(src, src_width, src_height, src_stride,
+                              dst_width, dst_height, 0, 0,
+                              dst, dst_width, dst_height, dst_stride, filter);
+}
+
+// ============================================================================
+// Streaming
+// ============================================================================
+
+// Smallest number of source rows collected before filtering them
+#define WW_STREAM_MIN_BATCH 16
+
+// The same scale, fed by a decoder a source row at a time. Rows are
+// collected into a small batch, the batch is filtered horizontally on the
+// worker pool into a ring, and every output row whose taps are then all in
+// the ring is finished, also in parallel. Only the batch, the ring and the
+// destination are ever held.
+struct ww_scale_stream
+{
+    struct ww_weights horizontal;
+    struct ww_weights vertical;
+    uint8_t *dst;
+    int dst_width;
+    int dst_height;
+    size_t dst_stride;
+
+    size_t src_row_bytes;
+    int first_row;          // source rows outside these are never read
+    int last_row;
+    int next_row;           // next source row to arrive
+
+    uint8_t *batch;         // raw source rows waiting for the pass
+    int batch_size;
+    int batch_count;
+    int batch_first;        // source row of batch[0]
+
+    size_t row_bytes;       // of a filtered row
+    uint8_t *ring;          // filtered rows, by source row modulo ring_size
+    int ring_size;
+    int next_out;           // next output row to finish
+
+    const uint8_t **rows;   // per worker thread, the ring rows one output row reads
+};
+
+static void stream_hpass(void *ctx, int index, int thread_id)
+{
+    (void)thread_id;
+    struct ww_scale_stream *stream = (struct ww_scale_stream*)ctx;
+    int sy = stream->batch_first + index;
+    hpass(stream->batch + stream->src_row_bytes * index,
+          stream->ring + stream->row_bytes * (sy % stream->ring_size),
+          stream->dst_width, &stream->horizontal);
+}
+
+static void stream_vpass(void *ctx, int index, int thread_id)
+{
+    struct ww_scale_stream *stream = (struct ww_scale_stream*)ctx;
+    int y = stream->next_out + index;
+    int taps = stream->vertical.taps;
+    int start = stream->vertical.start[y];
+
+    const uint8_t **rows = stream->rows + (size_t)thread_id * taps;
+    for (int k = 0; k < taps; k++) {
+        rows[k] = stream->ring + stream->row_bytes * ((start + k) % stream->ring_size);
+    }
+    vpass(rows, stream->vertical.coeffs + (size_t)y * taps, taps,
+          stream->dst + stream->dst_stride * y, (int)stream->row_bytes);
+}
+
+// Filter the collected rows, then finish what they complete
+static void stream_flush(struct ww_scale_stream *stream)
+{
+    if (stream->batch_count == 0) {
+        return;
+    }
+    ww_parallel_for(stream->batch_count, stream_hpass, stream);
+
+    int last = stream->batch_first + stream->batch_count - 1;
+    int taps = stream->vertical.taps;
+    int ready = stream->next_out;
+    while (ready < stream->dst_height && stream->vertical.start[ready] + taps - 1 <= last) {
+        ready++;
+    }
+    ww_parallel_for(ready - stream->next_out, stream_vpass, stream);
+
+    stream->next_out = ready;
+    stream->batch_first = last + 1;
+    stream->batch_count = 0;
+}
+
+ww_scale_stream *ww_scale_stream_create(int src_width, int src_height,
+                                        int window_x, int window_y, int window_width, int window_height,
+                                        int scaled_width, int scaled_height, int crop_x, int crop_y,
+                                        uint8_t *dst, int dst_width, int dst_height, size_t dst_stride,
+                                        ww_filter_t filter)
+{
+    if (!dst || src_width <= 0 || src_height <= 0 || dst_width <= 0 || dst_height <= 0 ||
+        crop_x < 0 || crop_y < 0 ||
+        crop_x + dst_width > scaled_width || crop_y + dst_height > scaled_height) {
+        return nullptr;
+    }
+
+    pick_kernels();
+
+    struct ww_scale_stream *stream = (struct ww_scale_stream*)calloc(1, sizeof(*stream));
+    if (!stream) {
+        return nullptr;
+    }
+    // Rows arrive a window wide; the vertical weights keep whole-image
+    // row numbers, which the pushes count in
+    if (!build_weights(&stream->horizontal, src_width, scaled_width, crop_x, dst_width, filter) ||
+        !build_weights(&stream->vertical, src_height, scaled_height, crop_y, dst_height, filter) ||
+        !shift_weights(&stream->horizontal, dst_width, window_x, window_width)) {
+        ww_scale_stream_destroy(stream);
+        return nullptr;
+    }
+
+    stream->dst = dst;
+    stream->dst_width = dst_width;
+    stream->dst_height = dst_height;
+    stream->dst_stride = dst_stride;
+    stream->src_row_bytes = (size_t)window_width * 4;
+    stream->row_bytes = (size_t)dst_width * 4;
+
+    int taps = stream->vertical.taps;
+    stream->first_row = stream->vertical.start[0];
+    stream->last_row = stream->vertical.start[dst_height - 1] + taps - 1;
+    stream->next_row = window_y;
+    stream->batch_first = stream->first_row;
+    if (stream->first_row < window_y || stream->last_row >= window_y + window_height) {
+        ww_scale_stream_destroy(stream);
+        return nullptr;
+    }
+
+    // Enough rows at once to keep every thread busy. A batch lands in the
+    // ring next to the taps - 1 rows the output rows still waiting on it
+    // need from the batch before.
+    stream->batch_size = ww_parallel_threads() * 4;
+    if (stream->batch_size < WW_STREAM_MIN_BATCH) {
+        stream->batch_size = WW_STREAM_MIN_BATCH;
+    }
+    stream->ring_size = stream->batch_size + taps;
+
+    stream->batch = (uint8_t*)malloc(stream->src_row_bytes * stream->batch_size);
+    stream->ring = (uint8_t*)malloc(stream->row_bytes * stream->ring_size);
+    stream->rows = (const uint8_t**)malloc(sizeof(*stream->rows) * taps * ww_parallel_threads());
+    if (!stream->batch || !stream->ring || !stream->rows) {
+        ww_scale_stream_destroy(stream);
+        return nullptr;
+    }
+    return stream;
+}
+
+// Hand over the next source row, top to bottom. Output rows are written
+// to the destination as soon as everything they read has arrived.
+void ww_scale_stream_push(ww_scale_stream *stream, const uint8_t *row)
+{
+    int sy = stream->next_row++;
+    if (sy < stream->first_row || sy > stream->last_row) {
+        return;
+    }
+
+    memcpy(stream->batch + stream->src_row_bytes * stream->batch_count, row, stream->src_row_bytes);
+    stream->batch_count++;
+    if (stream->batch_count == stream->batch_size || sy == stream->last_row) {
+        stream_flush(stream);
+    }
+}
+
+// Whether every output row has been written
+bool ww_scale_stream_done(const ww_scale_stream *stream)
+{
+    return stream->next_out == stream->dst_height;
+}
+
+void ww_scale_stream_destroy(ww_scale_stream *stream)
+{
+    if (!stream) {
+        return;
+    }
+    free_weights(&stream->horizontal);
+    free_weights(&stream->vertical);
+    free(stream->batch);
+    free(stream->ring);
+    free(stream->rows);
+    free(stream);
+}
@@ -3,6 +3,7 @@
 #include <cstdlib>
 #include <cstring>
 #include <pthread.h>
+#include <time.h>
 #include <unistd.h>
 
 extern "C" {
@@ -14,11 +15,24 @@ extern "C" {
 
 extern void set_error(const char *msg);
 
-struct image_data_t 
+// Frames decoded ahead of the one on screen. A keyframe that takes longer
+// than a frame to decode eats into this slack instead of stalling the
+// Wayland thread.
+#define WW_VIDEO_QUEUE 3
+
+// Frames are shown when their timestamps come due, not one per display
+// refresh. The decode thread skips scaling frames that are already over
+// when it gets to them, though never more than WW_VIDEO_MAX_SKIP in a row
+// so something still reaches the screen; and after a stall of more than
+// WW_VIDEO_MAX_LAG the clock moves up to the frame shown, rather than
+// racing through everything that was missed.
+#define WW_VIDEO_MAX_SKIP 8
+#define WW_VIDEO_MAX_LAG 0.5
+
+struct video_frame
 {
-    uint8_t *data;
-    int width, height;
-    int channels;
+    image_data_t *img;
+    double pts;                 // seconds since playback began, across loops
 };
 
 struct video_decoder_t 
@@ -35,14 +49,54 @@ struct video_decoder_t
     AVPacket *packet;
     
     double fps, frame_duration;
-    int64_t start_time;
+    int64_t start_time;         // CLOCK_MONOTONIC ns at pts 0, 0 until the first frame
+    
+    // Timestamps, kept by the decode thread
+    double time_base;           // seconds per stream tick
+    int64_t first_pts;          // stream ticks at the start of the file
+    double loop_offset;         // pts at which the current loop began
+    double next_pts;            // pts the next frame is expected at
+    int skipped;                // late frames skipped in a row
     
     bool loop, eof;
+    const char *error;          // why decoding stopped, when not at the end
+    
+    // The frame due last, shared by every caller of ww_video_frame();
+    // frames_out numbers it
+    image_data_t *current;
+    uint64_t frames_out;
+    
+    // Frames decoded ahead by the decode thread, in a ring: the thread
+    // fills the slot at head, the caller empties the one at tail, and each
+    // index is only ever written by its own side. lock and the conditions
+    // are only for sleeping when the ring is full or empty.
+    struct video_frame queue[WW_VIDEO_QUEUE];
+    unsigned head, tail;
+    pthread_t thread;
+    bool running;
+    bool stopping;              // the thread is asked to stop
+    bool done;                  // the thread stopped, at the end or on an error
+    pthread_cond_t space;       // a slot was freed
+    pthread_cond_t ready;       // a frame was queued, or the thread stopped
+    
+    ww_anim *anim;              // an animated WebP, played natively instead
+    ww_gif *gif;                // likewise a GIF
     
     pthread_mutex_t lock;
 };
 
-extern "C" video_decoder_t* ww_video_create(const char *path, int target_width, int target_height, bool loop) 
+static bool start_decoding(video_decoder_t *decoder);
+
+static int64_t monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// mode and bg_color only apply to GIFs and animated WebPs; ffmpeg
+// stretches every frame to the target size
+extern "C" video_decoder_t* ww_video_create(const char *path, int target_width, int target_height,
+                                            int mode, uint32_t bg_color, bool loop) 
 {
     if (!path) {
         set_error("NULL path provided");
@@ -60,17 +114,37 @@ extern "C" video_decoder_t* ww_video_create(const char *path, int target_width,
     decoder->loop = loop;
     decoder->video_stream_idx = -1;
     pthread_mutex_init(&decoder->lock, nullptr);
+    pthread_cond_init(&decoder->space, nullptr);
+    pthread_cond_init(&decoder->ready, nullptr);
+    
+    // libwebp composites the frames and keeps them decoded across loops,
+    // which ffmpeg's WebP support does neither of
+    if (ww_anim_probe(path)) {
+        decoder->anim = ww_anim_create(path, target_width, target_height, mode, bg_color, loop);
+        if (!decoder->anim) {
+            ww_video_destroy(decoder);
+            return nullptr;
+        }
+        return decoder;
+    }
+    
+    // A GIF too big to keep decoded still plays through ffmpeg
+    if (ww_gif_probe(path)) {
+        decoder->gif = ww_gif_create(path, target_width, target_height, mode, bg_color, loop);
+        if (decoder->gif) {
+            return decoder;
+        }
+    }
     
     if (avformat_open_input(&decoder->format_ctx, path, nullptr, nullptr) < 0) {
         set_error("Failed to open video file");
-        free(decoder);
+        ww_video_destroy(decoder);
         return nullptr;
     }
     
     if (avformat_find_stream_info(decoder->format_ctx, nullptr) < 0) {
         set_error("Failed to find stream info");
-        avformat_close_input(&decoder->format_ctx);
-        free(decoder);
+        ww_video_destroy(decoder);
         return nullptr;
     }
     
@@ -84,8 +158,7 @@ extern "C" video_decoder_t* ww_video_create(const char *path, int target_width,
     
     if (decoder->video_stream_idx == -1) {
         set_error("No video stream found");
-        avformat_close_input(&decoder->format_ctx);
-        free(decoder);
+        ww_video_destroy(decoder);
         return nullptr;
     }
     
@@ -94,39 +167,37 @@ extern "C" video_decoder_t* ww_video_create(const char *path, int target_width,
     const AVCodec *codec = avcodec_find_decoder(codecpar->codec_id);
     if (!codec) {
         set_error("Codec not found");
-        avformat_close_input(&decoder->format_ctx);
-        free(decoder);
+        ww_video_destroy(decoder);
         return nullptr;
     }
     
     decoder->codec_ctx = avcodec_alloc_context3(codec);
     if (!decoder->codec_ctx) {
         set_error("Failed to allocate codec context");
-        avformat_close_input(&decoder->format_ctx);
-        free(decoder);
+        ww_video_destroy(decoder);
         return nullptr;
     }
     
     if (avcodec_parameters_to_context(decoder->codec_ctx, codecpar) < 0) {
         set_error("Failed to copy codec parameters");
-        avcodec_free_context(&decoder->codec_ctx);
-        avformat_close_input(&decoder->format_ctx);
-        free(decoder);
+        ww_video_destroy(decoder);
         return nullptr;
     }
     
     if (avcodec_open2(decoder->codec_ctx, codec, nullptr) < 0) {
         set_error("Failed to open codec");
-        avcodec_free_context(&decoder->codec_ctx);
-        avformat_close_input(&decoder->format_ctx);
-        free(decoder);
+        ww_video_destroy(decoder);
         return nullptr;
     }
     
     decoder->width = decoder->codec_ctx->width;
     decoder->height = decoder->codec_ctx->height;
     
-    AVRational frame_rate = decoder->format_ctx->streams[decoder->video_stream_idx]->avg_frame_rate;
+    AVStream *stream = decoder->format_ctx->streams[decoder->video_stream_idx];
+    decoder->time_base = av_q2d(stream->time_base);
+    decoder->first_pts = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+    
+    AVRational frame_rate = stream->avg_frame_rate;
     if (frame_rate.num && frame_rate.den) {
         decoder->fps = (double)frame_rate.num / (double)frame_rate.den;
         decoder->frame_duration = 1.0 / decoder->fps;
@@ -140,11 +211,7 @@ extern "C" video_decoder_t* ww_video_create(const char *path, int target_width,
     
     if (!decoder->frame || !decoder->packet) {
         set_error("Failed to allocate frame/packet");
-        if (decoder->frame) av_frame_free(&decoder->frame);
-        if (decoder->packet) av_packet_free(&decoder->packet);
-        avcodec_free_context(&decoder->codec_ctx);
-        avformat_close_input(&decoder->format_ctx);
-        free(decoder);
+        ww_video_destroy(decoder);
         return nullptr;
     }
     
@@ -156,42 +223,40 @@ extern "C" video_decoder_t* ww_video_create(const char *path, int target_width,
     
     if (!decoder->sws_ctx) {
         set_error("Failed to initialize scaler");
-        av_frame_free(&decoder->frame);
-        av_packet_free(&decoder->packet);
-        avcodec_free_context(&decoder->codec_ctx);
-        avformat_close_input(&decoder->format_ctx);
-        free(decoder);
+        ww_video_destroy(decoder);
         return nullptr;
     }
     
-    return decoder;
-}
-
-extern "C" image_data_t* ww_video_next_frame(video_decoder_t *decoder) {
-    if (!decoder) {
-        set_error("NULL decoder");
+    if (!start_decoding(decoder)) {
+        set_error("Failed to start decode thread");
+        ww_video_destroy(decoder);
         return nullptr;
     }
     
-    pthread_mutex_lock(&decoder->lock);
-    
+    return decoder;
+}
+
+// Read, decode and scale the next frame, and give its pts. Only the decode
+// thread calls this, so the ffmpeg state needs no lock; errors are left for
+// the caller of ww_video_frame() to report, on its own thread.
+static image_data_t *decode_frame(video_decoder_t *decoder, double *pts) {
     while (true) {
         int ret = av_read_frame(decoder->format_ctx, decoder->packet);
         
         if (ret < 0) {
             if (ret == AVERROR_EOF) {
                 if (decoder->loop) {
+                    // The next loop carries on from where this one ended
+                    decoder->loop_offset = decoder->next_pts;
                     av_seek_frame(decoder->format_ctx, decoder->video_stream_idx, 0, AVSEEK_FLAG_BACKWARD);
                     avcodec_flush_buffers(decoder->codec_ctx);
                     continue;
                 } else {
                     decoder->eof = true;
-                    pthread_mutex_unlock(&decoder->lock);
                     return nullptr;
                 }
             } else {
-                set_error("Error reading frame");
-                pthread_mutex_unlock(&decoder->lock);
+                decoder->error = "Error reading frame";
                 return nullptr;
             }
         }
@@ -205,8 +270,7 @@ extern "C" image_data_t* ww_video_next_frame(video_decoder_t *decoder) {
         av_packet_unref(decoder->packet);
         
         if (ret < 0) {
-            set_error("Error sending packet to decoder");
-            pthread_mutex_unlock(&decoder->lock);
+            decoder->error = "Error sending packet to decoder";
             return nullptr;
         }
         
@@ -214,35 +278,43 @@ extern "C" image_data_t* ww_video_next_frame(video_decoder_t *decoder) {
         if (ret == AVERROR(EAGAIN)) {
             continue;
         } else if (ret < 0) {
-            set_error("Error receiving frame from decoder");
-            pthread_mutex_unlock(&decoder->lock);
+            decoder->error = "Error receiving frame from decoder";
             return nullptr;
         }
         
+        // Frames without a timestamp follow on from the one before
+        AVFrame *frame = decoder->frame;
+        int64_t timestamp = frame->best_effort_timestamp != AV_NOPTS_VALUE ?
+                            frame->best_effort_timestamp : frame->pts;
+        if (timestamp != AV_NOPTS_VALUE && decoder->time_base > 0) {
+            *pts = decoder->loop_offset + (timestamp - decoder->first_pts) * decoder->time_base;
+        } else {
+            *pts = decoder->next_pts;
+        }
+        double duration = frame->duration > 0 && decoder->time_base > 0 ?
+                          frame->duration * decoder->time_base : decoder->frame_duration;
+        decoder->next_pts = *pts + duration;
+        
+        // Over before it could be shown: the next one replaces it anyway
+        int64_t start = __atomic_load_n(&decoder->start_time, __ATOMIC_RELAXED);
+        if (start && decoder->skipped < WW_VIDEO_MAX_SKIP &&
+            start + (int64_t)(decoder->next_pts * 1e9) < monotonic_ns()) {
+            decoder->skipped++;
+            av_frame_unref(frame);
+            continue;
+        }
+        decoder->skipped = 0;
         break;
     }
     
-    image_data_t *img = (image_data_t*)malloc(sizeof(image_data_t));
+    image_data_t *img = ww_alloc_image(decoder->target_width, decoder->target_height);
     if (!img) {
-        set_error("Out of memory");
-        pthread_mutex_unlock(&decoder->lock);
-        return nullptr;
-    }
-    
-    img->width = decoder->target_width;
-    img->height = decoder->target_height;
-    img->channels = 4;
-    img->data = (uint8_t*)malloc(decoder->target_width * decoder->target_height * 4);
-    
-    if (!img->data) {
-        set_error("Out of memory");
-        free(img);
-        pthread_mutex_unlock(&decoder->lock);
+        decoder->error = "Out of memory";
         return nullptr;
     }
     
     uint8_t *dst_data[4] = { img->data, nullptr, nullptr, nullptr };
-    int dst_linesize[4] = { decoder->target_width * 4, 0, 0, 0 };
+    int dst_linesize[4] = { (int)img->stride, 0, 0, 0 };
     
     sws_scale(
         decoder->sws_ctx,
@@ -252,11 +324,194 @@ extern "C" image_data_t* ww_video_next_frame(video_decoder_t *decoder) {
     );
     
     av_frame_unref(decoder->frame);
+    
+    return img;
+}
+
+// The decode thread keeps the queue full, and stops at the end of a video
+// that does not loop, on an error, or when told to
+static void *decode_main(void *arg) {
+    video_decoder_t *decoder = (video_decoder_t*)arg;
+    
+    while (true) {
+        unsigned head = decoder->head;
+        
+        pthread_mutex_lock(&decoder->lock);
+        while (!decoder->stopping &&
+               head - __atomic_load_n(&decoder->tail, __ATOMIC_ACQUIRE) == WW_VIDEO_QUEUE) {
+            pthread_cond_wait(&decoder->space, &decoder->lock);
+        }
+        bool stopping = decoder->stopping;
+        pthread_mutex_unlock(&decoder->lock);
+        if (stopping) {
+            break;
+        }
+        
+        double pts = 0;
+        image_data_t *img = decode_frame(decoder, &pts);
+        if (img) {
+            decoder->queue[head % WW_VIDEO_QUEUE] = { img, pts };
+            __atomic_store_n(&decoder->head, head + 1, __ATOMIC_RELEASE);
+        }
+        
+        pthread_mutex_lock(&decoder->lock);
+        decoder->done = !img;
+        pthread_cond_signal(&decoder->ready);
+        pthread_mutex_unlock(&decoder->lock);
+        if (!img) {
+            break;
+        }
+    }
+    return nullptr;
+}
+
+static bool start_decoding(video_decoder_t *decoder) {
+    decoder->stopping = false;
+    decoder->done = false;
+    decoder->running = pthread_create(&decoder->thread, nullptr, decode_main, decoder) == 0;
+    return decoder->running;
+}
+
+// Stop the decode thread and drop whatever it had queued
+static void stop_decoding(video_decoder_t *decoder) {
+    if (decoder->running) {
+        pthread_mutex_lock(&decoder->lock);
+        decoder->stopping = true;
+        pthread_cond_signal(&decoder->space);
+        pthread_mutex_unlock(&decoder->lock);
+        pthread_join(decoder->thread, nullptr);
+        decoder->running = false;
+    }
+    while (decoder->tail != decoder->head) {
+        ww_free_image(decoder->queue[decoder->tail++ % WW_VIDEO_QUEUE].img);
+    }
+}
+
+// The pts of the oldest queued frame, false when there is none
+static bool peek_frame(video_decoder_t *decoder, double *pts) {
+    unsigned tail = decoder->tail;
+    if (__atomic_load_n(&decoder->head, __ATOMIC_ACQUIRE) == tail) {
+        return false;
+    }
+    *pts = decoder->queue[tail % WW_VIDEO_QUEUE].pts;
+    return true;
+}
+
+// Take the oldest queued frame, waiting for the decode thread when wait
+// is set and the queue is empty. Null when there is none: the queue ran
+// dry, or the video is over.
+static image_data_t *take_frame(video_decoder_t *decoder, bool wait, double *pts) {
+    unsigned tail = decoder->tail;
+    if (__atomic_load_n(&decoder->head, __ATOMIC_ACQUIRE) == tail) {
+        if (!wait) {
+            return nullptr;
+        }
+        pthread_mutex_lock(&decoder->lock);
+        while (__atomic_load_n(&decoder->head, __ATOMIC_ACQUIRE) == tail && !decoder->done) {
+            pthread_cond_wait(&decoder->ready, &decoder->lock);
+        }
+        pthread_mutex_unlock(&decoder->lock);
+        if (__atomic_load_n(&decoder->head, __ATOMIC_ACQUIRE) == tail) {
+            return nullptr;
+        }
+    }
+    
+    image_data_t *img = decoder->queue[tail % WW_VIDEO_QUEUE].img;
+    *pts = decoder->queue[tail % WW_VIDEO_QUEUE].pts;
+    __atomic_store_n(&decoder->tail, tail + 1, __ATOMIC_RELEASE);
+    
+    // The slot is free; wake the decode thread if it waits for one
+    pthread_mutex_lock(&decoder->lock);
+    pthread_cond_signal(&decoder->space);
     pthread_mutex_unlock(&decoder->lock);
+    return img;
+}
+
+extern "C" image_data_t* ww_video_next_frame(video_decoder_t *decoder) {
+    if (!decoder) {
+        set_error("NULL decoder");
+        return nullptr;
+    }
+    
+    if (decoder->anim || decoder->gif) {
+        uint64_t seq = 0;
+        image_data_t *img = nullptr;
+        ww_video_frame(decoder, &seq, &img);
+        return img;
+    }
     
+    double pts;
+    image_data_t *img = take_frame(decoder, true, &pts);
+    if (!img && decoder->error) {
+        set_error(decoder->error);
+    }
     return img;
 }
 
+// A video has a new frame once the clock reaches the pts of a queued one;
+// when several are due only the last is kept. The first frame, which a
+// caller with none yet waits for, starts the clock. An animation likewise
+// has one when the clock has moved past the caller's.
+extern "C" int ww_video_frame(video_decoder_t *decoder, uint64_t *seq, image_data_t **frame) {
+    if (!decoder) {
+        set_error("NULL decoder");
+        return -1;
+    }
+    
+    if (decoder->anim) {
+        return ww_anim_frame(decoder->anim, seq, frame);
+    }
+    if (decoder->gif) {
+        return ww_gif_frame(decoder->gif, seq, frame);
+    }
+    
+    double pts;
+    if (!decoder->current) {
+        decoder->current = take_frame(decoder, true, &pts);
+        if (!decoder->current) {
+            set_error(decoder->error ? decoder->error : "Video has no frames");
+            return -1;
+        }
+        decoder->frames_out++;
+        __atomic_store_n(&decoder->start_time, monotonic_ns() - (int64_t)(pts * 1e9), __ATOMIC_RELAXED);
+    } else {
+        int64_t now = monotonic_ns();
+        bool taken = false;
+        while (peek_frame(decoder, &pts) && decoder->start_time + (int64_t)(pts * 1e9) <= now) {
+            ww_free_image(decoder->current);
+            decoder->current = take_frame(decoder, false, &pts);
+            decoder->frames_out++;
+            taken = true;
+        }
+        if (taken && now - decoder->start_time - (int64_t)(pts * 1e9) > (int64_t)(WW_VIDEO_MAX_LAG * 1e9)) {
+            __atomic_store_n(&decoder->start_time, now - (int64_t)(pts * 1e9), __ATOMIC_RELAXED);
+        }
+    }
+    
+    if (*seq == decoder->frames_out) {
+        // Nothing due yet, and the caller keeps its frame; at the end it keeps it for good
+        pthread_mutex_lock(&decoder->lock);
+        bool done = decoder->done && __atomic_load_n(&decoder->head, __ATOMIC_ACQUIRE) == decoder->tail;
+        pthread_mutex_unlock(&decoder->lock);
+        if (done && decoder->error) {
+            set_error(decoder->error);
+        }
+        return done ? -1 : 0;
+    }
+    *seq = decoder->frames_out;
+    *frame = ww_ref_image(decoder->current);
+    return 1;
+}
+
+// Only GIFs keep track of what changed; other frames are new all over
+extern "C" bool ww_video_damage(video_decoder_t *decoder, uint64_t since, uint64_t seq,
+                                int *x, int *y, int *width, int *height) {
+    if (!decoder || !decoder->gif) {
+        return false;
+    }
+    return ww_gif_damage(decoder->gif, since, seq, x, y, width, height);
+}
+
 extern "C" double ww_video_get_frame_duration(video_decoder_t *decoder) {
     if (!decoder) {
         return 1.0 / 30.0; // Default 30 FPS
@@ -268,19 +523,34 @@ extern "C" bool ww_video_is_eof(video_decoder_t *decoder) {
     if (!decoder) {
         return true;
     }
-    return decoder->eof;
+    
+    // Over once the frames queued before the end are shown too
+    pthread_mutex_lock(&decoder->lock);
+    bool eof = decoder->done && decoder->eof &&
+               __atomic_load_n(&decoder->head, __ATOMIC_ACQUIRE) == decoder->tail;
+    pthread_mutex_unlock(&decoder->lock);
+    return eof;
 }
 
 extern "C" void ww_video_seek_start(video_decoder_t *decoder) {
-    if (!decoder) {
+    if (!decoder || decoder->anim || decoder->gif) {
         return;
     }
     
-    pthread_mutex_lock(&decoder->lock);
+    stop_decoding(decoder);
     av_seek_frame(decoder->format_ctx, decoder->video_stream_idx, 0, AVSEEK_FLAG_BACKWARD);
     avcodec_flush_buffers(decoder->codec_ctx);
     decoder->eof = false;
-    pthread_mutex_unlock(&decoder->lock);
+    decoder->error = nullptr;
+    decoder->loop_offset = 0;
+    decoder->next_pts = 0;
+    decoder->skipped = 0;
+    
+    // Playback starts over with the next frame taken
+    ww_free_image(decoder->current);
+    decoder->current = nullptr;
+    decoder->start_time = 0;
+    start_decoding(decoder);
 }
 
 extern "C" void ww_video_destroy(video_decoder_t *decoder) {
@@ -288,7 +558,16 @@ extern "C" void ww_video_destroy(video_decoder_t *decoder) {
         return;
     }
     
-    pthread_mutex_lock(&decoder->lock);
+    stop_decoding(decoder);
+    ww_free_image(decoder->current);
+    
+    if (decoder->anim) {
+        ww_anim_destroy(decoder->anim);
+    }
+    
+    if (decoder->gif) {
+        ww_gif_destroy(decoder->gif);
+    }
     
     if (decoder->sws_ctx) {
         sws_freeContext(decoder->sws_ctx);
@@ -310,7 +589,8 @@ extern "C" void ww_video_destroy(video_decoder_t *decoder) {
         avformat_close_input(&decoder->format_ctx);
     }
     
-    pthread_mutex_unlock(&decoder->lock);
+    pthread_cond_destroy(&decoder->space);
+    pthread_cond_destroy(&decoder->ready);
     pthread_mutex_destroy(&decoder->lock);
     
     free(decoder);
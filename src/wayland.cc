@@ -26,6 +26,7 @@ struct ww_state {
     struct wl_compositor *compositor;
     struct wl_shm *shm;
     struct zwlr_layer_shell_v1 *layer_shell;
+    uint32_t shm_format; // Pixel format for every buffer we create
     
     struct wl_list outputs; // List of ww_output
     
@@ -51,37 +52,74 @@ struct ww_output {
     
     struct wl_surface *surface;
     struct zwlr_layer_surface_v1 *layer_surface;
-    struct wl_buffer *buffer;
-    uint8_t *buffer_data;
-    size_t buffer_size;
+    struct ww_shm_pool *pool;
+    struct ww_buffer *current; // Last buffer committed to the surface
     
     struct wl_callback *frame_callback;
+    uint64_t frame_seq; // Animation frame on screen, as ww_video_frame() counts
     
     bool configured;
     
     // Transition state
     ww_transition_state *transition;
-    uint8_t *old_buffer_data;
-    size_t old_buffer_size;
     struct timespec transition_start;
 };
 
+// Buffers per output. One is on screen, one is being drawn, and a third
+// covers a compositor that holds on to the previous frame a little longer.
+// They share one mapping, and pages of a buffer that is never drawn into
+// are never allocated.
+#define WW_POOL_BUFFERS 3
+
+struct ww_shm_pool;
+
 struct ww_buffer {
     uint8_t *data;
     size_t size;
     int width;
     int height;
     struct wl_buffer *buffer;
+    struct ww_shm_pool *pool;
+    int users; // Outputs showing this buffer; it may be on several at once
+    bool busy; // Attached, and not yet released by the compositor
+    bool populated; // Pages faulted in
+    uint64_t frame_seq; // Animation frame it holds, 0 for anything else
+};
+
+// Owned by one output, but kept alive while any output still shows one of
+// its buffers: refs is the owner's reference plus every buffer's users.
+struct ww_shm_pool {
+    int refs;
+    uint8_t *data; // Single mapping backing every buffer
+    size_t size;
+    int width;
+    int height;
+    uint32_t format;
+    struct ww_buffer buffers[WW_POOL_BUFFERS];
 };
 
 static struct ww_state *global_state = nullptr;
 
 // Forward declarations
 extern void set_error(const char *msg);
-extern image_data_t *ww_load_image_mode(const char *path, int output_width, int output_height, int mode, uint32_t bg_color);
+extern int ww_render_file(const char *path, int mode, uint32_t bg_color,
+                          ww_render_target_t *targets, int count);
+extern image_data_t *ww_render_image(image_data_t *img, int output_width, int output_height, int mode, uint32_t bg_color);
+extern image_data_t *ww_alloc_image(int width, int height);
+extern image_data_t *ww_ref_image(image_data_t *img);
 extern void ww_free_image(image_data_t *img);
-extern video_decoder_t *ww_video_create(const char *path, int target_width, int target_height, bool loop);
-extern image_data_t *ww_video_next_frame(video_decoder_t *decoder);
+extern void ww_fill_rgba(uint8_t *dst, size_t pixels, uint32_t color);
+extern void ww_swizzle_rgba(uint8_t *dst, const uint8_t *src, size_t pixels);
+extern int ww_decode_image_into(const char *path, uint8_t *dst, int width, int height, size_t stride, bool bgra);
+extern int ww_probe_image(const char *path, int *width, int *height);
+extern image_data_t *ww_decode_preview(const char *path, int width, int height, bool *full);
+extern void ww_parallel_shutdown(void);
+extern video_decoder_t *ww_video_create(const char *path, int target_width, int target_height,
+                                        int mode, uint32_t bg_color, bool loop);
+extern int ww_video_frame(video_decoder_t *decoder, uint64_t *seq, image_data_t **frame);
+extern bool ww_video_damage(video_decoder_t *decoder, uint64_t since, uint64_t seq,
+                            int *x, int *y, int *width, int *height);
+extern bool ww_anim_probe(const char *path);
 extern double ww_video_get_frame_duration(video_decoder_t *decoder);
 extern void ww_video_destroy(video_decoder_t *decoder);
 extern ww_transition_state *ww_transition_create(ww_transition_type_t type, float duration, int width, int height);
@@ -90,19 +128,16 @@ extern void ww_transition_start(ww_transition_state *state, const uint8_t *old_d
 extern bool ww_transition_update(ww_transition_state *state, float delta_time, uint8_t **output_data);
 extern bool ww_transition_is_active(const ww_transition_state *state);
 
-// Access image data internals (opaque type implementation)
-struct image_data_t {
-    uint8_t *data;
-    int width;
-    int height;
-    int channels;
-};
-
 // ============================================================================
 // Shared Memory Helpers
 // ============================================================================
 
-static int create_shm_file(size_t size) {
+// Pools at least this big (a 4K frame is ~33MB) get huge pages where the
+// kernel's shmem policy allows them
+#define WW_SHM_LARGE_SIZE ((size_t)16 << 20)
+
+// Anonymous tmpfs file in $XDG_RUNTIME_DIR, for kernels without memfd_create
+static int create_shm_tmpfile(size_t size) {
     const char *xdg_runtime = getenv("XDG_RUNTIME_DIR");
     if (!xdg_runtime) {
         set_error("XDG_RUNTIME_DIR not set");
@@ -129,36 +164,266 @@ static int create_shm_file(size_t size) {
     return fd;
 }
 
-// Create shared memory buffer
-static struct wl_buffer* create_shm_buffer(struct wl_shm *shm, uint8_t **data_out, 
-                                          int width, int height) {
+static int create_shm_file(size_t size) {
+#ifdef MFD_ALLOW_SEALING
+    // memfd never touches a directory, and lets us seal the size: the
+    // compositor can then map the pool without guarding against it being
+    // truncated under it.
+    int fd = memfd_create("ww-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd >= 0) {
+        if (ftruncate(fd, size) < 0) {
+            set_error("Failed to truncate shared memory file");
+            close(fd);
+            return -1;
+        }
+        fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL);
+        return fd;
+    }
+    // ENOSYS on kernels before 3.17; fall through
+#endif
+    return create_shm_tmpfile(size);
+}
+
+// Fault in a buffer's pages in one go, before it is first drawn into,
+// instead of one page fault at a time in the middle of a frame
+static void prefault_buffer(struct ww_buffer *buffer) {
+#ifdef MADV_POPULATE_WRITE
+    // EINVAL before Linux 5.14; the pages then fault in as they are written
+    madvise(buffer->data, buffer->size, MADV_POPULATE_WRITE);
+#endif
+    buffer->populated = true;
+}
+
+// ABGR8888 and XBGR8888 are R, G, B, A in memory (wl_shm formats are
+// little-endian), which is the order every loader and the scaler produce.
+static bool format_is_rgba_order(uint32_t format) {
+    return format == WL_SHM_FORMAT_ABGR8888 || format == WL_SHM_FORMAT_XBGR8888;
+}
+
+// Copy an image into a packed buffer of the given format. Plain memcpys
+// when the byte orders agree, a per-pixel swizzle otherwise. The image may
+// be a view with its own stride.
+static void write_image(uint8_t *dst, const image_data_t *img, uint32_t format) {
+    // Wayland WL_SHM_FORMAT_ARGB8888 is stored as BGRA in memory
+    bool swap = format_is_rgba_order(format) != (img->format == WW_PIXEL_RGBA);
+    size_t row_bytes = (size_t)img->width * 4;
+    
+    if (img->stride == row_bytes) {
+        size_t pixel_count = (size_t)img->width * (size_t)img->height;
+        if (swap) {
+            ww_swizzle_rgba(dst, img->data, pixel_count);
+        } else {
+            memcpy(dst, img->data, pixel_count * 4);
+        }
+        return;
+    }
+    
+    for (int y = 0; y < img->height; y++) {
+        const uint8_t *row = img->data + img->stride * y;
+        if (swap) {
+            ww_swizzle_rgba(dst + row_bytes * y, row, img->width);
+        } else {
+            memcpy(dst + row_bytes * y, row, row_bytes);
+        }
+    }
+}
+
+// Copy the rect at (x, y) of an image into the same place in a packed
+// buffer of the image's size
+static void write_image_rect(uint8_t *dst, const image_data_t *img, uint32_t format,
+                             int x, int y, int width, int height) {
+    bool swap = format_is_rgba_order(format) != (img->format == WW_PIXEL_RGBA);
+    size_t row_bytes = (size_t)img->width * 4;
+    
+    for (int row = y; row < y + height; row++) {
+        uint8_t *out = dst + row_bytes * row + (size_t)x * 4;
+        const uint8_t *in = img->data + img->stride * row + (size_t)x * 4;
+        if (swap) {
+            ww_swizzle_rgba(out, in, width);
+        } else {
+            memcpy(out, in, (size_t)width * 4);
+        }
+    }
+}
+
+static void buffer_release(void *data, struct wl_buffer *wl_buffer) {
+    (void)wl_buffer;
+    struct ww_buffer *buffer = (struct ww_buffer*)data;
+    buffer->busy = false;
+}
+
+static const struct wl_buffer_listener buffer_listener = {
+    .release = buffer_release,
+};
+
+static void destroy_shm_pool(struct ww_shm_pool *pool) {
+    if (!pool) {
+        return;
+    }
+    
+    for (int i = 0; i < WW_POOL_BUFFERS; i++) {
+        if (pool->buffers[i].buffer) {
+            wl_buffer_destroy(pool->buffers[i].buffer);
+        }
+    }
+    if (pool->data) {
+        munmap(pool->data, pool->size);
+    }
+    free(pool);
+}
+
+// Create WW_POOL_BUFFERS buffers of one size, carved from one wl_shm_pool
+static struct ww_shm_pool* create_shm_pool(struct wl_shm *shm, int width, int height,
+                                           uint32_t format) {
     // size_t: width * 4 * height in int overflows around 23000x23000, and these
     // dimensions can come from a decoded file.
     if (width <= 0 || height <= 0)
         return nullptr;
-    size_t stride = (size_t)width * 4; // RGBA
-    size_t size = stride * (size_t)height;
+    size_t stride = (size_t)width * 4;
+    size_t buffer_size = stride * (size_t)height;
+    size_t size = buffer_size * WW_POOL_BUFFERS;
+    
+    // wl_shm_pool sizes and offsets are int32
+    if (size > INT32_MAX) {
+        set_error("Buffer too large for wl_shm");
+        return nullptr;
+    }
+    
+    struct ww_shm_pool *pool = (struct ww_shm_pool*)calloc(1, sizeof(struct ww_shm_pool));
+    if (!pool) {
+        set_error("Out of memory");
+        return nullptr;
+    }
     
     int fd = create_shm_file(size);
     if (fd < 0) {
+        free(pool);
         return nullptr;
     }
     
-    uint8_t *data = (uint8_t*)mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int flags = MAP_SHARED;
+#ifndef MADV_POPULATE_WRITE
+    // No per-buffer prefault available: populate the whole pool up front
+    // for large outputs, even the buffer that may never be drawn into.
+    if (size >= WW_SHM_LARGE_SIZE)
+        flags |= MAP_POPULATE;
+#endif
+    
+    uint8_t *data = (uint8_t*)mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, fd, 0);
     if (data == MAP_FAILED) {
         set_error("Failed to mmap shared memory");
         close(fd);
+        free(pool);
         return nullptr;
     }
     
-    struct wl_shm_pool *pool = wl_shm_create_pool(shm, fd, size);
-    struct wl_buffer *buffer = wl_shm_pool_create_buffer(pool, 0, width, height, 
-                                                         stride, WL_SHM_FORMAT_ARGB8888);
-    wl_shm_pool_destroy(pool);
+    // Only a hint: honoured when shmem_enabled is "advise" or "always". Has
+    // to come before the pages are touched.
+    if (size >= WW_SHM_LARGE_SIZE)
+        madvise(data, size, MADV_HUGEPAGE);
+    
+    pool->refs = 1;
+    pool->data = data;
+    pool->size = size;
+    pool->width = width;
+    pool->height = height;
+    pool->format = format;
+    
+    struct wl_shm_pool *wl_pool = wl_shm_create_pool(shm, fd, size);
+    for (int i = 0; i < WW_POOL_BUFFERS; i++) {
+        struct ww_buffer *buffer = &pool->buffers[i];
+        buffer->data = data + buffer_size * i;
+        buffer->size = buffer_size;
+        buffer->width = width;
+        buffer->height = height;
+        buffer->pool = pool;
+        buffer->buffer = wl_shm_pool_create_buffer(wl_pool, buffer_size * i, width, height,
+                                                   stride, format);
+        wl_buffer_add_listener(buffer->buffer, &buffer_listener, buffer);
+    }
+    // The buffers keep the pool alive on the compositor side
+    wl_shm_pool_destroy(wl_pool);
     close(fd);
     
-    *data_out = data;
-    return buffer;
+    return pool;
+}
+
+static void unref_shm_pool(struct ww_shm_pool *pool) {
+    if (pool && --pool->refs == 0) {
+        destroy_shm_pool(pool);
+    }
+}
+
+// Make a buffer the one the output shows, moving the output's reference
+// off the buffer it showed before
+static void set_current_buffer(struct ww_output *output, struct ww_buffer *buffer) {
+    struct ww_buffer *old = output->current;
+    if (buffer) {
+        buffer->users++;
+        buffer->pool->refs++;
+    }
+    output->current = buffer;
+    if (old) {
+        old->users--;
+        unref_shm_pool(old->pool);
+    }
+}
+
+// Get a buffer of the given size the compositor is not reading from,
+// reusing the output's pool when the size still fits. Returns nullptr when
+// every buffer is still held by the compositor or shown on some output.
+static struct ww_buffer* acquire_buffer(struct ww_output *output, int width, int height) {
+    struct ww_state *state = output->state;
+    struct ww_shm_pool *pool = output->pool;
+    
+    if (!pool || pool->width != width || pool->height != height ||
+        pool->format != state->shm_format) {
+        // The old pool lives on while its buffer is still on screen
+        unref_shm_pool(pool);
+        output->pool = nullptr;
+        
+        // A running transition was drawn for the old size
+        if (output->transition) {
+            ww_transition_destroy(output->transition);
+            output->transition = nullptr;
+        }
+        
+        pool = create_shm_pool(state->shm, width, height, state->shm_format);
+        if (!pool) {
+            return nullptr;
+        }
+        output->pool = pool;
+    }
+    
+    // Never hand out a buffer that is on screen: a compositor that already
+    // released it may still need it again, and transitions read from it.
+    for (int i = 0; i < WW_POOL_BUFFERS; i++) {
+        struct ww_buffer *buffer = &pool->buffers[i];
+        if (!buffer->busy && buffer->users == 0) {
+            if (!buffer->populated)
+                prefault_buffer(buffer);
+            return buffer;
+        }
+    }
+    
+    return nullptr;
+}
+
+// Attach a buffer and damage the rect of it that differs from what the
+// surface showed; the caller commits
+static void attach_buffer_damage(struct ww_output *output, struct ww_buffer *buffer,
+                                 int x, int y, int width, int height) {
+    buffer->busy = true;
+    buffer->frame_seq = 0;
+    set_current_buffer(output, buffer);
+    wl_surface_attach(output->surface, buffer->buffer, 0, 0);
+    wl_surface_damage_buffer(output->surface, x, y, width, height);
+}
+
+// Attach a buffer and damage all of it; the caller commits. The same
+// buffer may be attached to several outputs' surfaces.
+static void attach_buffer(struct ww_output *output, struct ww_buffer *buffer) {
+    attach_buffer_damage(output, buffer, 0, 0, buffer->width, buffer->height);
 }
 
 // ============================================================================
@@ -292,11 +557,6 @@ static void transition_frame_callback_handler(void *data, struct wl_callback *ca
     
     if (!output->transition || !ww_transition_is_active(output->transition)) {
         // Transition complete, clean up
-        if (output->old_buffer_data) {
-            munmap(output->old_buffer_data, output->old_buffer_size);
-            output->old_buffer_data = nullptr;
-            output->old_buffer_size = 0;
-        }
         if (output->transition) {
             ww_transition_destroy(output->transition);
             output->transition = nullptr;
@@ -314,31 +574,19 @@ static void transition_frame_callback_handler(void *data, struct wl_callback *ca
     uint8_t *transition_output = nullptr;
     bool still_active = ww_transition_update(output->transition, delta_time, &transition_output);
     
-    if (transition_output && output->buffer_data) {
-        // Copy transition output to buffer (RGBA to BGRA conversion).
-        //
-        // Bounded by buffer_size rather than width*height: the transition is
-        // only started when the image and output dimensions agree, but nothing
-        // re-checks that here, and output->width/height change under us on a
-        // mode switch or hotplug while buffer_size does not.
-        size_t pixel_count = (size_t)output->width * (size_t)output->height;
-        if (pixel_count > output->buffer_size / 4)
-            pixel_count = output->buffer_size / 4;
-        for (size_t i = 0; i < pixel_count; i++) {
-            uint8_t r = transition_output[i * 4 + 0];
-            uint8_t g = transition_output[i * 4 + 1];
-            uint8_t b = transition_output[i * 4 + 2];
-            uint8_t a = transition_output[i * 4 + 3];
-            
-            output->buffer_data[i * 4 + 0] = b;
-            output->buffer_data[i * 4 + 1] = g;
-            output->buffer_data[i * 4 + 2] = r;
-            output->buffer_data[i * 4 + 3] = a;
-        }
+    if (transition_output) {
+        // The transition runs on buffers already in the surface's pixel
+        // format and is dropped whenever the pool changes size, so its
+        // output is exactly one buffer's worth.
+        struct ww_buffer *buffer = output->pool ?
+            acquire_buffer(output, output->pool->width, output->pool->height) : nullptr;
         
-        // Attach and commit
-        wl_surface_attach(output->surface, output->buffer, 0, 0);
-        wl_surface_damage_buffer(output->surface, 0, 0, output->width, output->height);
+        if (buffer) {
+            memcpy(buffer->data, transition_output, buffer->size);
+            attach_buffer(output, buffer);
+        }
+        // With every buffer still held by the compositor this frame is
+        // skipped; the transition is time based and catches up on the next.
         
         if (still_active) {
             // Setup next frame callback
@@ -351,11 +599,6 @@ static void transition_frame_callback_handler(void *data, struct wl_callback *ca
     
     // Clean up if transition is done
     if (!still_active) {
-        if (output->old_buffer_data) {
-            munmap(output->old_buffer_data, output->old_buffer_size);
-            output->old_buffer_data = nullptr;
-            output->old_buffer_size = 0;
-        }
         if (output->transition) {
             ww_transition_destroy(output->transition);
             output->transition = nullptr;
@@ -368,50 +611,52 @@ static void update_animated_frame(struct ww_output *output) {
         return;
     }
     
-    // Get next frame
-    image_data_t *img = ww_video_next_frame(output->state->video_decoder);
-    if (!img) {
+    // Get the frame due now. An animation whose frame is still current
+    // only asks for the next callback.
+    video_decoder_t *decoder = output->state->video_decoder;
+    uint64_t shown = output->frame_seq;
+    image_data_t *img = nullptr;
+    int status = ww_video_frame(decoder, &output->frame_seq, &img);
+    if (status < 0) {
         // Video ended or error
         return;
     }
     
-    // Create new buffer if needed
-    size_t needed_size = img->width * img->height * 4;
-    if (!output->buffer || output->buffer_size != needed_size) {
-        if (output->buffer) {
-            wl_buffer_destroy(output->buffer);
-            if (output->buffer_data) {
-                munmap(output->buffer_data, output->buffer_size);
+    // Reuses the pool unless the frame size changed. When the compositor
+    // still holds every buffer the frame is dropped rather than drawn over
+    // one it may be reading, and tried again on the next callback.
+    //
+    // The buffer we get holds an older frame than the one on screen, so
+    // what it needs redrawn is everything that changed since its frame;
+    // the compositor only needs to hear about what changed since the one
+    // on screen.
+    if (img) {
+        struct ww_buffer *buffer = acquire_buffer(output, img->width, img->height);
+        if (buffer) {
+            int x, y, width, height;
+            if (buffer->frame_seq &&
+                ww_video_damage(decoder, buffer->frame_seq, output->frame_seq, &x, &y, &width, &height)) {
+                write_image_rect(buffer->data, img, output->state->shm_format, x, y, width, height);
+            } else {
+                write_image(buffer->data, img, output->state->shm_format);
+            }
+            
+            if (!ww_video_damage(decoder, shown, output->frame_seq, &x, &y, &width, &height)) {
+                x = 0;
+                y = 0;
+                width = buffer->width;
+                height = buffer->height;
             }
+            attach_buffer_damage(output, buffer, x, y, width, height);
+            buffer->frame_seq = output->frame_seq;
+        } else if (!output->pool) {
+            ww_free_image(img);
+            return;
+        } else {
+            output->frame_seq = shown;
         }
-        
-        output->buffer_size = needed_size;
-        output->buffer = create_shm_buffer(output->state->shm, &output->buffer_data,
-                                          img->width, img->height);
-    }
-    
-    if (!output->buffer) {
-        ww_free_image(img);
-        return;
-    }
-    
-    // Copy frame data to buffer (convert RGBA to BGRA)
-    for (int i = 0; i < img->width * img->height; i++) {
-        uint8_t r = img->data[i * 4 + 0];
-        uint8_t g = img->data[i * 4 + 1];
-        uint8_t b = img->data[i * 4 + 2];
-        uint8_t a = img->data[i * 4 + 3];
-        
-        output->buffer_data[i * 4 + 0] = b;
-        output->buffer_data[i * 4 + 1] = g;
-        output->buffer_data[i * 4 + 2] = r;
-        output->buffer_data[i * 4 + 3] = a;
     }
     
-    // Attach and commit
-    wl_surface_attach(output->surface, output->buffer, 0, 0);
-    wl_surface_damage_buffer(output->surface, 0, 0, img->width, img->height);
-    
     // Setup next frame callback
     if (output->frame_callback) {
         wl_callback_destroy(output->frame_callback);
@@ -436,6 +681,29 @@ static void frame_callback_handler(void *data, struct wl_callback *callback, uin
     update_animated_frame(output);
 }
 
+// ============================================================================
+// Shared Memory Format Callbacks
+// ============================================================================
+
+static void shm_format(void *data, struct wl_shm *shm, uint32_t format) {
+    (void)shm;
+    struct ww_state *state = (struct ww_state*)data;
+    
+    // ARGB8888 is mandatory and stays the fallback. Prefer the formats that
+    // match our RGBA memory order so frames can be copied without a swizzle;
+    // ABGR over XBGR to keep the alpha channel we have always sent.
+    if (format == WL_SHM_FORMAT_ABGR8888) {
+        state->shm_format = format;
+    } else if (format == WL_SHM_FORMAT_XBGR8888 &&
+               state->shm_format != WL_SHM_FORMAT_ABGR8888) {
+        state->shm_format = format;
+    }
+}
+
+static const struct wl_shm_listener shm_listener = {
+    .format = shm_format,
+};
+
 // ============================================================================
 // Wayland Registry Callbacks
 // ============================================================================
@@ -450,6 +718,7 @@ static void registry_global(void *data, struct wl_registry *registry,
                                                       &wl_compositor_interface, 4);
     } else if (strcmp(interface, wl_shm_interface.name) == 0) {
         state->shm = (struct wl_shm*)wl_registry_bind(registry, name, &wl_shm_interface, 1);
+        wl_shm_add_listener(state->shm, &shm_listener, state);
     } else if (strcmp(interface, wl_output_interface.name) == 0) {
         struct ww_output *output = (struct ww_output*)calloc(1, sizeof(struct ww_output));
         output->state = state;
@@ -482,6 +751,268 @@ static const struct wl_registry_listener registry_listener = {
     .global_remove = registry_global_remove,
 };
 
+// An image rendered at one output size, shared by every output of that size
+struct ww_render {
+    int width;
+    int height;
+    int users;                // Outputs showing it
+    image_data_t *img;
+    bool direct;              // No img: decoded straight into a wl_buffer
+    struct ww_buffer *buffer; // Shown on those outputs, once drawn
+};
+
+static image_data_t* create_solid_image(int width, int height, uint32_t color) {
+    image_data_t *img = ww_alloc_image(width, height);
+    if (!img) {
+        return nullptr;
+    }
+    
+    // Fill with solid color
+    ww_fill_rgba(img->data, (size_t)width * (size_t)height, color);
+    
+    return img;
+}
+
+// Render every distinct output size of an image that isn't decoded
+// straight into its buffer, with one decode between them
+static int render_image_sizes(const ww_config_t *config, struct ww_render *renders, int render_count) {
+    ww_render_target_t *sizes = (ww_render_target_t*)calloc(render_count, sizeof(*sizes));
+    int *render_of = (int*)calloc(render_count, sizeof(int));
+    if (!sizes || !render_of) {
+        free(sizes);
+        free(render_of);
+        return -1;
+    }
+    
+    int count = 0;
+    for (int r = 0; r < render_count; r++) {
+        if (!renders[r].direct) {
+            sizes[count].width = renders[r].width;
+            sizes[count].height = renders[r].height;
+            render_of[count++] = r;
+        }
+    }
+    
+    int result = 0;
+    if (count > 0) {
+        result = ww_render_file(config->file_path, config->mode, config->bg_color, sizes, count);
+    }
+    for (int i = 0; i < count && result == 0; i++) {
+        renders[render_of[i]].img = sizes[i].img;
+    }
+    
+    free(sizes);
+    free(render_of);
+    return result;
+}
+
+// Put a rendered, output-sized image on one output, through a transition
+// when one is configured and possible. Outputs showing the same render pass
+// the same *shared: the first one to show the image without a transition
+// stores its buffer there, and the rest attach that buffer instead of
+// drawing their own copy.
+static int present_wallpaper(struct ww_output *output, const ww_config_t *config,
+                             const struct ww_render *render, bool is_animated,
+                             struct ww_buffer **shared) {
+    struct ww_state *state = output->state;
+    
+    // Check if we should do a transition. The buffer on screen is the old
+    // frame, so it has to be the same size as the new one.
+    bool should_transition = (config->transition != WW_TRANSITION_NONE && 
+                             config->transition_duration > 0.0f &&
+                             output->current != nullptr &&
+                             output->current->width == render->width &&
+                             output->current->height == render->height &&
+                             render->width == output->width &&
+                             render->height == output->height &&
+                             !is_animated);
+    
+    // Create surface
+    if (!output->surface) {
+        output->surface = wl_compositor_create_surface(state->compositor);
+        if (!output->surface) {
+            set_error("Failed to create surface");
+            return -1;
+        }
+    }
+    
+    // Create layer surface
+    if (!output->layer_surface) {
+        output->layer_surface = zwlr_layer_shell_v1_get_layer_surface(
+            state->layer_shell, output->surface, output->wl_output,
+            ZWLR_LAYER_SHELL_V1_LAYER_BACKGROUND, "wallpaper");
+        
+        if (!output->layer_surface) {
+            set_error("Failed to create layer surface");
+            return -1;
+        }
+        
+        // Configure layer surface
+        zwlr_layer_surface_v1_set_size(output->layer_surface, output->width, output->height);
+        zwlr_layer_surface_v1_set_anchor(output->layer_surface,
+            ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP |
+            ZWLR_LAYER_SURFACE_V1_ANCHOR_BOTTOM |
+            ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT |
+            ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT);
+        zwlr_layer_surface_v1_set_exclusive_zone(output->layer_surface, -1);
+        
+        zwlr_layer_surface_v1_add_listener(output->layer_surface, 
+                                          &layer_surface_listener, output);
+        
+        wl_surface_commit(output->surface);
+        wl_display_roundtrip(state->display);
+    }
+    
+    // A frame callback from an earlier transition or video must not
+    // fire into this wallpaper
+    if (output->frame_callback) {
+        wl_callback_destroy(output->frame_callback);
+        output->frame_callback = nullptr;
+    }
+    
+    // An output of the same size already has this image in a buffer
+    if (!should_transition && shared && *shared) {
+        attach_buffer(output, *shared);
+        wl_surface_commit(output->surface);
+        return 0;
+    }
+    
+    // Get a buffer from the output's pool. The one on screen stays
+    // untouched, so it doubles as the old frame of a transition.
+    struct ww_buffer *buffer = acquire_buffer(output, render->width, render->height);
+    if (!buffer && output->pool) {
+        // Every buffer is still held, e.g. mid-transition; let the
+        // compositor catch up and release them.
+        wl_display_roundtrip(state->display);
+        buffer = acquire_buffer(output, render->width, render->height);
+    }
+    if (!buffer) {
+        set_error("Failed to create buffer");
+        return -1;
+    }
+    
+    size_t pixel_count = (size_t)render->width * (size_t)render->height;
+    if (render->img) {
+        write_image(buffer->data, render->img, state->shm_format);
+    } else if (ww_decode_image_into(config->file_path, buffer->data, render->width, render->height,
+                                    (size_t)render->width * 4,
+                                    !format_is_rgba_order(state->shm_format)) != 0) {
+        set_error("Failed to load image");
+        return -1;
+    }
+    
+    // Handle transition if requested
+    if (should_transition) {
+        
+        // Transitions only blend and move whole pixels, so they run
+        // directly in the buffer's pixel format: the old frame is the
+        // buffer on screen, the new one the buffer just written.
+        if (output->transition) {
+            ww_transition_destroy(output->transition);
+        }
+        
+        output->transition = ww_transition_create(config->transition, 
+                                                 config->transition_duration,
+                                                 render->width, render->height);
+        
+        if (output->transition) {
+            ww_transition_start(output->transition, output->current->data, buffer->data);
+            clock_gettime(CLOCK_MONOTONIC, &output->transition_start);
+            
+            // Copy initial frame (first transition frame)
+            uint8_t *transition_output = nullptr;
+            ww_transition_update(output->transition, 0.0f, &transition_output);
+            
+            if (transition_output) {
+                memcpy(buffer->data, transition_output, pixel_count * 4);
+                
+                // Start transition animation
+                attach_buffer(output, buffer);
+                output->frame_callback = wl_surface_frame(output->surface);
+                wl_callback_add_listener(output->frame_callback, &transition_frame_listener, output);
+                wl_surface_commit(output->surface);
+                return 0; // Skip normal rendering for this output
+            }
+        }
+    }
+    
+    // Normal immediate update (no transition)
+    attach_buffer(output, buffer);
+    if (shared) {
+        *shared = buffer;
+    }
+    
+    // For animated content, setup frame callback
+    if (is_animated) {
+        buffer->frame_seq = output->frame_seq;
+        output->frame_callback = wl_surface_frame(output->surface);
+        wl_callback_add_listener(output->frame_callback, &frame_listener, output);
+    }
+    
+    wl_surface_commit(output->surface);
+    return 0;
+}
+
+// Put a cheap preview of the image on every target before the real decode
+// starts. The preview has the image's aspect ratio, so rendering it in the
+// same mode gives the same layout the full image will have. Returns whether
+// anything was shown. A file with no cheap preview that had to be decoded
+// whole to find that out is handed back in *full instead, for the caller
+// to render rather than decode it again.
+static bool show_preview(const ww_config_t *config, int image_width, int image_height,
+                         struct ww_output **targets, const int *target_render, int target_count,
+                         const struct ww_render *renders, int render_count, image_data_t **full) {
+    // Centre and tile lay pixels out 1:1, which a smaller image can't stand in for
+    if (config->mode != WW_MODE_FIT && config->mode != WW_MODE_FILL &&
+        config->mode != WW_MODE_STRETCH) {
+        return false;
+    }
+    
+    bool complete;
+    image_data_t *preview = ww_decode_preview(config->file_path, image_width, image_height, &complete);
+    if (!preview) {
+        return false;
+    }
+    if (complete) {
+        *full = preview;
+        return false;
+    }
+    
+    struct ww_render *previews = (struct ww_render*)calloc(render_count, sizeof(*previews));
+    if (!previews) {
+        ww_free_image(preview);
+        return false;
+    }
+    
+    bool shown = true;
+    for (int r = 0; r < render_count && shown; r++) {
+        previews[r].width = renders[r].width;
+        previews[r].height = renders[r].height;
+        previews[r].img = ww_render_image(preview, renders[r].width, renders[r].height,
+                                          config->mode, config->bg_color);
+        shown = previews[r].img != nullptr;
+    }
+    
+    // Straight onto the screen: a transition into a stand-in is no use
+    ww_config_t quick = *config;
+    quick.transition = WW_TRANSITION_NONE;
+    for (int t = 0; t < target_count && shown; t++) {
+        struct ww_render *render = &previews[target_render[t]];
+        shown = present_wallpaper(targets[t], &quick, render, false, &render->buffer) == 0;
+    }
+    
+    if (shown) {
+        wl_display_flush(global_state->display);
+    }
+    
+    for (int r = 0; r < render_count; r++) {
+        ww_free_image(previews[r].img);
+    }
+    free(previews);
+    ww_free_image(preview);
+    return shown;
+}
+
 // Public API implementation
 extern "C" {
 
@@ -498,6 +1029,7 @@ int ww_init(void) {
     }
     
     wl_list_init(&state->outputs);
+    state->shm_format = WL_SHM_FORMAT_ARGB8888;
     
     // Connect to Wayland display
     state->display = wl_display_connect(nullptr);
@@ -543,7 +1075,7 @@ int ww_init(void) {
         return -1;
     }
     
-    // Wait for output configuration
+    // Wait for output configuration (and the wl_shm format list)
     wl_display_roundtrip(state->display);
     
     global_state = state;
@@ -568,12 +1100,11 @@ void ww_cleanup(void) {
         if (output->frame_callback) {
             wl_callback_destroy(output->frame_callback);
         }
-        if (output->buffer_data) {
-            munmap(output->buffer_data, output->buffer_size);
-        }
-        if (output->buffer) {
-            wl_buffer_destroy(output->buffer);
+        if (output->transition) {
+            ww_transition_destroy(output->transition);
         }
+        set_current_buffer(output, nullptr);
+        unref_shm_pool(output->pool);
         if (output->layer_surface) {
             zwlr_layer_surface_v1_destroy(output->layer_surface);
         }
@@ -609,6 +1140,8 @@ void ww_cleanup(void) {
     
     free(state);
     global_state = nullptr;
+    
+    ww_parallel_shutdown();
 }
 
 int ww_list_outputs(ww_output_t **outputs, int *count) {
@@ -687,12 +1220,27 @@ int ww_set_wallpaper_no_loop(const ww_config_t *config) {
     // Check if this is animated content
     bool is_animated = (config->type == WW_TYPE_GIF || 
                        config->type == WW_TYPE_MP4 || 
-                       config->type == WW_TYPE_WEBM);
+                       config->type == WW_TYPE_WEBM ||
+                       (config->type == WW_TYPE_WEBP && ww_anim_probe(config->file_path)));
     
     state->is_animated = is_animated;
     state->wallpaper_path = config->file_path;
     
+    // The last wallpaper's animation stops here. Buffers it drew hold
+    // frame numbers the next one counts from again.
+    if (state->video_decoder) {
+        ww_video_destroy(state->video_decoder);
+        state->video_decoder = nullptr;
+    }
+    struct ww_output *output;
+    wl_list_for_each(output, &state->outputs, link) {
+        for (int i = 0; output->pool && i < WW_POOL_BUFFERS; i++) {
+            output->pool->buffers[i].frame_seq = 0;
+        }
+    }
+    
     // For animated content, create video decoder
+    int video_width = 0, video_height = 0;
     if (is_animated) {
         // Use first output dimensions for decoder
         struct ww_output *first_output = wl_container_of(state->outputs.next, first_output, link);
@@ -704,10 +1252,14 @@ int ww_set_wallpaper_no_loop(const ww_config_t *config) {
         state->video_decoder = ww_video_create(config->file_path, 
                                               first_output->width, 
                                               first_output->height,
+                                              config->mode,
+                                              config->bg_color,
                                               config->loop);
         if (!state->video_decoder) {
             return -1;
         }
+        video_width = first_output->width;
+        video_height = first_output->height;
     }
     
     // A name matching no output used to fall straight through the loop below
@@ -732,8 +1284,24 @@ int ww_set_wallpaper_no_loop(const ww_config_t *config) {
         }
     }
 
-    // Iterate through outputs and set wallpaper
-    struct ww_output *output;
+    // Outputs to draw on, and one rendered image per distinct output size.
+    // Mode and background colour are the same for every output in a call,
+    // so the size alone decides whether two outputs can share a render, and
+    // with it a wl_buffer.
+    int output_count = wl_list_length(&state->outputs);
+    struct ww_output **targets = (struct ww_output**)calloc(output_count + 1, sizeof(*targets));
+    int *target_render = (int*)calloc(output_count + 1, sizeof(int));
+    struct ww_render *renders = (struct ww_render*)calloc(output_count + 1, sizeof(*renders));
+    if (!targets || !target_render || !renders) {
+        free(targets);
+        free(target_render);
+        free(renders);
+        set_error("Out of memory");
+        return -1;
+    }
+    
+    int target_count = 0;
+    int render_count = 0;
     wl_list_for_each(output, &state->outputs, link) {
         if (!output->configured) {
             continue;
@@ -745,228 +1313,111 @@ int ww_set_wallpaper_no_loop(const ww_config_t *config) {
             continue;
         }
         
-        // Check if we should do a transition
-        bool should_transition = (config->transition != WW_TRANSITION_NONE && 
-                                 config->transition_duration > 0.0f &&
-                                 output->buffer_data != nullptr &&
-                                 output->buffer_size > 0 &&
-                                 !is_animated);
-        
-        // Save old buffer for transition if needed
-        uint8_t *old_buffer_copy = nullptr;
-        if (should_transition) {
-            old_buffer_copy = (uint8_t*)malloc(output->buffer_size);
-            if (old_buffer_copy) {
-                memcpy(old_buffer_copy, output->buffer_data, output->buffer_size);
-            } else {
-                should_transition = false;
-            }
+        // Video frames come out at the decoder's size, whatever the output
+        int width = output->width;
+        int height = output->height;
+        if (is_animated) {
+            width = video_width;
+            height = video_height;
         }
         
-        // Load image (static or first frame) or create solid color
-        image_data_t *img = nullptr;
-        
-        if (config->type == WW_TYPE_SOLID_COLOR) {
-            // Create solid color image
-            img = (image_data_t*)malloc(sizeof(image_data_t));
-            if (!img) {
-                set_error("Out of memory");
-                return -1;
-            }
-            
-            img->width = output->width;
-            img->height = output->height;
-            img->channels = 4;
-            img->data = (uint8_t*)malloc(output->width * output->height * 4);
-            
-            if (!img->data) {
-                free(img);
-                set_error("Out of memory");
-                return -1;
-            }
-            
-            // Fill with solid color
-            uint8_t r = (config->bg_color >> 24) & 0xFF;
-            uint8_t g = (config->bg_color >> 16) & 0xFF;
-            uint8_t b = (config->bg_color >> 8) & 0xFF;
-            uint8_t a = config->bg_color & 0xFF;
-            
-            for (int i = 0; i < output->width * output->height; i++) {
-                img->data[i * 4 + 0] = r;
-                img->data[i * 4 + 1] = g;
-                img->data[i * 4 + 2] = b;
-                img->data[i * 4 + 3] = a;
-            }
-        } else if (is_animated) {
-            // Get first frame from video decoder
-            img = ww_video_next_frame(state->video_decoder);
-            if (!img) {
-                set_error("Failed to decode first frame");
-                return -1;
-            }
-        } else {
-            // Load static image with scaling mode
-            img = ww_load_image_mode(config->file_path, 
-                                    output->width, output->height,
-                                    config->mode, config->bg_color);
-            if (!img) {
-                set_error("Failed to load image");
-                return -1;
-            }
+        int r = 0;
+        while (r < render_count && (renders[r].width != width || renders[r].height != height)) {
+            r++;
         }
-        
-        // Create surface
-        if (!output->surface) {
-            output->surface = wl_compositor_create_surface(state->compositor);
-            if (!output->surface) {
-                set_error("Failed to create surface");
-                ww_free_image(img);
-                return -1;
-            }
+        if (r == render_count) {
+            renders[r].width = width;
+            renders[r].height = height;
+            render_count++;
         }
+        renders[r].users++;
         
-        // Create layer surface
-        if (!output->layer_surface) {
-            output->layer_surface = zwlr_layer_shell_v1_get_layer_surface(
-                state->layer_shell, output->surface, output->wl_output,
-                ZWLR_LAYER_SHELL_V1_LAYER_BACKGROUND, "wallpaper");
-            
-            if (!output->layer_surface) {
-                set_error("Failed to create layer surface");
-                ww_free_image(img);
-                return -1;
-            }
-            
-            // Configure layer surface
-            zwlr_layer_surface_v1_set_size(output->layer_surface, output->width, output->height);
-            zwlr_layer_surface_v1_set_anchor(output->layer_surface,
-                ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP |
-                ZWLR_LAYER_SURFACE_V1_ANCHOR_BOTTOM |
-                ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT |
-                ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT);
-            zwlr_layer_surface_v1_set_exclusive_zone(output->layer_surface, -1);
-            
-            zwlr_layer_surface_v1_add_listener(output->layer_surface, 
-                                              &layer_surface_listener, output);
-            
-            wl_surface_commit(output->surface);
-            wl_display_roundtrip(state->display);
-        }
+        targets[target_count] = output;
+        target_render[target_count] = r;
+        target_count++;
+    }
+    
+    // An image already the size of its outputs is decoded straight into
+    // the buffer the first of them shows, and the others share that
+    // buffer. A transition needs its own buffer per output, though, so with
+    // several outputs it is cheaper to decode once and copy.
+    ww_config_t final_config;
+    image_data_t *decoded = nullptr;
+    if (config->type != WW_TYPE_SOLID_COLOR && !is_animated) {
+        bool transitions = config->transition != WW_TRANSITION_NONE &&
+                           config->transition_duration > 0.0f;
+        int image_width = 0, image_height = 0;
+        bool probed = ww_probe_image(config->file_path, &image_width, &image_height) == 0;
         
-        // Create shared memory buffer
-        if (output->buffer) {
-            wl_buffer_destroy(output->buffer);
-            if (output->buffer_data) {
-                munmap(output->buffer_data, output->buffer_size);
-            }
+        // With a preview on screen the full image replaces it directly
+        if (config->progressive && probed &&
+            show_preview(config, image_width, image_height,
+                         targets, target_render, target_count, renders, render_count, &decoded)) {
+            final_config = *config;
+            final_config.transition = WW_TRANSITION_NONE;
+            config = &final_config;
+            transitions = false;
         }
         
-        output->buffer_size = img->width * img->height * 4;
-        output->buffer = create_shm_buffer(state->shm, &output->buffer_data,
-                                          img->width, img->height);
-        if (!output->buffer) {
-            set_error("Failed to create buffer");
-            ww_free_image(img);
-            return -1;
+        for (int r = 0; r < render_count; r++) {
+            renders[r].direct = probed && !decoded &&
+                                renders[r].width == image_width &&
+                                renders[r].height == image_height &&
+                                (renders[r].users == 1 || !transitions);
         }
-        
-        // Handle transition if requested
-        if (should_transition && old_buffer_copy && 
-            img->width == output->width && img->height == output->height) {
-            
-            // Create new buffer data in RGBA format for transition
-            uint8_t *new_buffer_rgba = (uint8_t*)malloc(img->width * img->height * 4);
-            uint8_t *old_buffer_rgba = (uint8_t*)malloc(img->width * img->height * 4);
-            
-            if (new_buffer_rgba && old_buffer_rgba) {
-                // Copy new image data (already in RGBA)
-                memcpy(new_buffer_rgba, img->data, img->width * img->height * 4);
-                
-                // Convert old buffer from BGRA to RGBA
-                int pixel_count = img->width * img->height;
-                for (int i = 0; i < pixel_count; i++) {
-                    old_buffer_rgba[i * 4 + 0] = old_buffer_copy[i * 4 + 2]; // R
-                    old_buffer_rgba[i * 4 + 1] = old_buffer_copy[i * 4 + 1]; // G
-                    old_buffer_rgba[i * 4 + 2] = old_buffer_copy[i * 4 + 0]; // B
-                    old_buffer_rgba[i * 4 + 3] = old_buffer_copy[i * 4 + 3]; // A
-                }
-                
-                // Create and start transition
-                if (output->transition) {
-                    ww_transition_destroy(output->transition);
-                }
-                
-                output->transition = ww_transition_create(config->transition, 
-                                                         config->transition_duration,
-                                                         img->width, img->height);
-                
-                if (output->transition) {
-                    ww_transition_start(output->transition, old_buffer_rgba, new_buffer_rgba);
-                    clock_gettime(CLOCK_MONOTONIC, &output->transition_start);
-                    
-                    // Copy initial frame (first transition frame)
-                    uint8_t *transition_output = nullptr;
-                    ww_transition_update(output->transition, 0.0f, &transition_output);
-                    
-                    if (transition_output) {
-                        // Convert RGBA to BGRA and copy to buffer
-                        for (int i = 0; i < pixel_count; i++) {
-                            output->buffer_data[i * 4 + 0] = transition_output[i * 4 + 2]; // B
-                            output->buffer_data[i * 4 + 1] = transition_output[i * 4 + 1]; // G
-                            output->buffer_data[i * 4 + 2] = transition_output[i * 4 + 0]; // R
-                            output->buffer_data[i * 4 + 3] = transition_output[i * 4 + 3]; // A
-                        }
-                        
-                        // Start transition animation
-                        wl_surface_attach(output->surface, output->buffer, 0, 0);
-                        wl_surface_damage_buffer(output->surface, 0, 0, img->width, img->height);
-                        output->frame_callback = wl_surface_frame(output->surface);
-                        wl_callback_add_listener(output->frame_callback, &transition_frame_listener, output);
-                        wl_surface_commit(output->surface);
-                    }
-                }
+    }
+    
+    // Then decode once and scale once per distinct size
+    int result = 0;
+    uint64_t frame_seq = 0;
+    if (is_animated) {
+        // Video frames come out at one size for every output, so every
+        // output starts on the same decoded frame
+        image_data_t *frame = nullptr;
+        if (ww_video_frame(state->video_decoder, &frame_seq, &frame) > 0) {
+            for (int r = 0; r < render_count; r++) {
+                renders[r].img = r == 0 ? frame : ww_ref_image(frame);
             }
-            
-            if (new_buffer_rgba) free(new_buffer_rgba);
-            if (old_buffer_rgba) free(old_buffer_rgba);
-            if (old_buffer_copy) free(old_buffer_copy);
-            ww_free_image(img);
-            continue; // Skip normal rendering for this output
         }
-        
-        if (old_buffer_copy) {
-            free(old_buffer_copy);
+    } else if (config->type == WW_TYPE_SOLID_COLOR) {
+        for (int r = 0; r < render_count; r++) {
+            renders[r].img = create_solid_image(renders[r].width, renders[r].height, config->bg_color);
         }
-        
-        // Normal immediate update (no transition)
-        // Copy image data to buffer (convert RGBA to ARGB for Wayland)
-        for (int i = 0; i < img->width * img->height; i++) {
-            uint8_t r = img->data[i * 4 + 0];
-            uint8_t g = img->data[i * 4 + 1];
-            uint8_t b = img->data[i * 4 + 2];
-            uint8_t a = img->data[i * 4 + 3];
-            
-            // Wayland WL_SHM_FORMAT_ARGB8888 is native endian ARGB
-            // On little-endian (x86), this is stored as BGRA in memory
-            output->buffer_data[i * 4 + 0] = b;
-            output->buffer_data[i * 4 + 1] = g;
-            output->buffer_data[i * 4 + 2] = r;
-            output->buffer_data[i * 4 + 3] = a;
+    } else if (decoded) {
+        for (int r = 0; r < render_count; r++) {
+            renders[r].img = ww_render_image(decoded, renders[r].width, renders[r].height,
+                                             config->mode, config->bg_color);
         }
-        
-        // Attach buffer and commit
-        wl_surface_attach(output->surface, output->buffer, 0, 0);
-        wl_surface_damage_buffer(output->surface, 0, 0, img->width, img->height);
-        
-        // For animated content, setup frame callback
-        if (is_animated) {
-            output->frame_callback = wl_surface_frame(output->surface);
-            wl_callback_add_listener(output->frame_callback, &frame_listener, output);
+        ww_free_image(decoded);
+    } else {
+        render_image_sizes(config, renders, render_count);
+    }
+    
+    for (int r = 0; r < render_count; r++) {
+        if (!renders[r].img && !renders[r].direct) {
+            set_error(is_animated ? "Failed to decode first frame" : "Failed to load image");
+            result = -1;
+            break;
         }
-        
-        wl_surface_commit(output->surface);
-        
-        ww_free_image(img);
+    }
+    
+    for (int t = 0; t < target_count && result == 0; t++) {
+        // Video outputs each go on to draw their own frames
+        struct ww_render *render = &renders[target_render[t]];
+        targets[t]->frame_seq = frame_seq;
+        result = present_wallpaper(targets[t], config, render, is_animated,
+                                   is_animated ? nullptr : &render->buffer);
+    }
+    
+    for (int r = 0; r < render_count; r++) {
+        ww_free_image(renders[r].img);
+    }
+    free(targets);
+    free(target_render);
+    free(renders);
+    
+    if (result != 0) {
+        return result;
     }
     
     // Flush and ensure compositor processes everything
@@ -26,8 +26,8 @@ target("ww")
     -- wayland stuff
     add_packages("wayland", "wayland-protocols")
 
-    -- image formats (stb handles PNG, JPEG, BMP, TGA, GIF, PNM)
-    add_packages("stb", "libwebp", "libtiff", "libjxl")
+    -- image formats (stb handles PNG, BMP, TGA, GIF, PNM; libjpeg-turbo JPEG)
+    add_packages("stb", "libjpeg-turbo", "libwebp", "libtiff", "libjxl")
 
     -- video support
     add_packages("ffmpeg")
@@ -60,6 +60,7 @@ target_end()
 add_requires("wayland")
 add_requires("wayland-protocols")
 add_requires("stb")
+add_requires("libjpeg-turbo")
 add_requires("libwebp")
 add_requires("libtiff")
 add_requires("libjxl")